@@ -71,7 +71,7 @@ struct app_t {
 
         // bind a projection matrix
         mat4f_t proj;
-        n3d_frustum(proj, -1.f, 1.f, -1.f, 1.f, 1.f, 1.f / 100.f);
+        n3d_frustum(proj, -1.f, 1.f, -1.f, 1.f, 1.f, 100.f);
         n3d_.bind(&proj, n3d_projection);
 
         delta = 0.f;
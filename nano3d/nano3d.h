@@ -3,6 +3,15 @@
 #include "source/n3d_decl.h"
 #include "source/n3d_config.h"
 
+// bounding box definition
+//      an axis aligned box in object space which encloses
+//      every vertex of a vertex buffer.
+struct n3d_bounds_t {
+
+    vec3f_t    min_;
+    vec3f_t    max_;
+};
+
 // vertex buffer definition
 //      this can be bound to and n3d pipeline
 struct n3d_vertex_buffer_t {
@@ -13,6 +22,9 @@ struct n3d_vertex_buffer_t {
     const vec3f_t * pos_;
     const vec2f_t * uv_;
     const vec3f_t * rgb_;
+    // optional bounds of pos_, which lets draws and instances
+    // outside of the view frustum be skipped before vertex processing
+    const n3d_bounds_t * bounds_;
 };
 
 // texture definition
@@ -52,6 +64,52 @@ struct n3d_user_data_t {
     };
 };
 
+// pipeline statistics
+//      counters gathered by the front end over one frame which show
+//      how many triangles were culled at each stage.
+struct n3d_stats_t {
+
+    // triangles submitted by draw calls, for each instance drawn
+    uint32_t   triangles_;
+    // draws and instances culled by their bounds
+    uint32_t   culled_bounds_;
+    // triangles culled outside of the view frustum
+    uint32_t   culled_frustum_;
+    // triangles culled as back facing or with zero area
+    uint32_t   culled_backface_;
+    // triangles culled for not covering any pixel centre
+    uint32_t   culled_coverage_;
+    // triangles which survived setup
+    uint32_t   setup_;
+};
+
+// pipeline settings
+//      optional tuning which can be passed to start().  any field
+//      left as zero will use a default value.
+struct n3d_settings_t {
+
+    // memory in bytes which commands queued to the bins may use.
+    // when exceeded the thread submitting draws helps to drain the
+    // bins before continuing.
+    uint32_t   command_budget_;
+    // size of the bins the frame is divided into, in pixels.  the
+    // width is rounded up to a multiple of 16.  when zero a size is
+    // picked from the target size and number of threads.  start()
+    // fails if either side is below 16.
+    uint32_t   bin_width_;
+    uint32_t   bin_height_;
+    // when non zero each worker thread is pinned to its own cpu,
+    // spread evenly over the numa nodes of the machine.
+    uint32_t   pin_threads_;
+    // when non zero present() hands the frame to the worker threads and
+    // returns straight away, so the next frame can be drawn while it is
+    // rasterized.  use wait() before reading the render target.
+    uint32_t   pipeline_frames_;
+};
+
+// identifies a presented frame which can be waited on
+typedef uint32_t n3d_fence_t;
+
 // rasterizer definition
 //      a rasterizer can be bound to an n3d pipeline.  it is
 //      responsible for transforming a triangle setup into output
@@ -156,11 +214,22 @@ enum n3d_target_e {
 
 // primitive stitching mode
 enum n3d_primitive_e {
+    // each three indices form a triangle
     n3d_prim_tri,
-    n3d_prim_tri_stip,
+    // each index after the second forms a triangle with the two before it
+    n3d_prim_tri_strip,
+    // each index after the second forms a triangle with the one before it
+    // and the first index
     n3d_prim_tri_fan,
 };
 
+// a user task, called once for each index of a task set.  thread is 0 for
+// the thread using nano3d_t and 1 + worker index for the worker threads.
+typedef void (*n3d_task_func_t)(void *user, uint32_t index, uint32_t thread);
+
+// handle to a set of running tasks
+struct n3d_task_set_t;
+
 struct nano3d_t {
 
     nano3d_t();
@@ -176,9 +245,11 @@ struct nano3d_t {
     //      num_planes  - number of additional colour planes to allocate.
     //                    each colour plane is 32bits per pixel.
     //      num_threads - number of worker threads to spawn for rendering.
+    //      settings    - optional pipeline tuning, or nullptr for defaults.
     n3d_result_e start(const n3d_target_t *target,
                        const uint32_t num_planes,
-                       const uint32_t num_threads);
+                       const uint32_t num_threads,
+                       const n3d_settings_t *settings = nullptr);
 
     // description:
     //      shut down the rendering context.
@@ -223,6 +294,16 @@ struct nano3d_t {
     //      texture     - texture to bind to pipeline
     n3d_result_e bind(const n3d_texture_t * texture);
 
+    // description:
+    //      bind a new render target to the n3d pipeline, which must be the
+    //      same size as the one passed to start().  when frames are
+    //      pipelined this lets the next frame be drawn into another buffer
+    //      while the last one is still being rasterized.
+    //
+    // inputs:
+    //      target      - render target to draw following commands into
+    n3d_result_e bind(const n3d_target_t *target);
+
     // description:
     //      bind a matrix to the n3d pipeline which will transform
     //      vertices from world space to ndc space.  the bound matrix will
@@ -250,15 +331,80 @@ struct nano3d_t {
     // inputs:
     //      num         - number of raw indices to process
     //      indices     - stream of vertex indices
+    //      mode        - how the indices are stitched into triangles
     n3d_result_e draw(const uint32_t num,
-                      const uint32_t * indices
-                      /* const uint32_t mode */);
+                      const uint32_t * indices,
+                      const n3d_primitive_e mode = n3d_prim_tri);
+
+    // description:
+    //      rasterize many instances of the same elements from the currently
+    //      bound vertex buffer.  each instance is transformed by its own
+    //      matrix followed by the bound model view and projection matrices.
+    //
+    // inputs:
+    //      num         - number of raw indices to process
+    //      indices     - stream of vertex indices
+    //      num_instances - number of instances to draw
+    //      instances   - per instance model matrices
+    //      mode        - how the indices are stitched into triangles
+    n3d_result_e draw_instanced(const uint32_t num,
+                                const uint32_t * indices,
+                                const uint32_t num_instances,
+                                const mat4f_t * instances,
+                                const n3d_primitive_e mode = n3d_prim_tri);
 
     // description:
     //      flush the pipeline and make sure all output is present
     //      in the given render target.
+    //      when frames are pipelined this returns once the frame has been
+    //      handed off, and only blocks while the frame before it is still
+    //      being rasterized.  bound buffers must then remain valid until
+    //      the frame has been waited on.
     //
-    n3d_result_e present();
+    // outputs:
+    //      fence       - optional fence to wait on for this frame
+    n3d_result_e present(n3d_fence_t * fence = nullptr);
+
+    // description:
+    //      block until a presented frame is complete in its render target.
+    //      the calling thread helps rasterize while it waits.
+    //
+    // inputs:
+    //      fence       - fence returned by present()
+    n3d_result_e wait(const n3d_fence_t fence);
+
+    // description:
+    //      run a task for each index in a range on the worker threads and
+    //      return without waiting for them.  the workers pick up tasks
+    //      before rasterizing, and tasks must not call into nano3d_t.
+    //
+    // inputs:
+    //      func        - task to run for each index
+    //      user        - user data passed to each task
+    //      count       - number of indices to run
+    //
+    // outputs:
+    //      tasks       - handle to pass to join()
+    n3d_result_e run_tasks(n3d_task_func_t func,
+                           void * user,
+                           const uint32_t count,
+                           n3d_task_set_t ** tasks);
+
+    // description:
+    //      wait for a set of tasks to finish.  tasks which no worker has
+    //      started yet are run on this thread.  the handle is released.
+    //
+    // inputs:
+    //      tasks       - handle returned by run_tasks()
+    n3d_result_e join(n3d_task_set_t * tasks);
+
+    // description:
+    //      get the pipeline statistics for the last presented frame.
+    //
+    // output:
+    //      out         - counters gathered between the last two calls
+    //                    to present().
+    n3d_result_e stats(n3d_stats_t * out);
 
     // description:
     //      project a point from world space to screen space.
@@ -284,6 +430,87 @@ struct nano3d_t {
                            vec3f_t * dir,
                            vec3f_t * origin);
 
+protected:
+    friend struct n3d_stream_t;
+
+    // hidden implementation
+    struct detail_t;
+    detail_t * detail_;
+};
+
+// draw stream
+//      a stream records draws for a context on another thread, so that
+//      several threads can feed one context at once.  the recording thread
+//      transforms, sets up and bins its own triangles, which are then sent
+//      to the bins when the context presents.  a stream has its own vertex
+//      buffer and matrices, and must only be used by one thread at a time.
+//
+//      recorded draws belong to the frame being built, so a stream must
+//      submit everything it records before the context next calls present(),
+//      and draw() or submit() must not overlap a call to present() or wait().
+struct n3d_stream_t {
+
+    // description:
+    //      create a stream which submits to a context.  the context must
+    //      have been started and must outlive the stream, and the stream
+    //      must not hold unsubmitted draws when it is destroyed.
+    //
+    // inputs:
+    //      context     - context to submit draws to
+    n3d_stream_t(nano3d_t & context);
+    n3d_stream_t(const n3d_stream_t &) = delete;
+    ~n3d_stream_t();
+
+    // description:
+    //      bind a vertex buffer for following draws in this stream.
+    //      the bound vertex buffer must remain valid until the frame it is
+    //      drawn in has been presented.
+    n3d_result_e bind(const n3d_vertex_buffer_t *buffer);
+
+    // description:
+    //      record a change of rasterizer, which the bins will use from this
+    //      point in the stream onwards.  until then its draws use whichever
+    //      rasterizer the bins were left with by the commands sent before.
+    n3d_result_e bind(const n3d_rasterizer_t *rasterizer);
+
+    // description:
+    //      record a change of texture, as with the rasterizer.
+    n3d_result_e bind(const n3d_texture_t *texture);
+
+    // description:
+    //      bind a matrix for following draws in this stream.
+    n3d_result_e bind(const mat4f_t *matrix,
+                      const n3d_matrix_e slot);
+
+    // description:
+    //      record a draw from the currently bound vertex buffer.  this must
+    //      not overlap present() or wait() on the context.
+    n3d_result_e draw(const uint32_t num,
+                      const uint32_t *indices,
+                      const n3d_primitive_e mode = n3d_prim_tri);
+
+    // description:
+    //      record many instances of a draw.
+    n3d_result_e draw_instanced(const uint32_t num,
+                                const uint32_t *indices,
+                                const uint32_t num_instances,
+                                const mat4f_t *instances,
+                                const n3d_primitive_e mode = n3d_prim_tri);
+
+    // description:
+    //      hand the draws recorded so far to the context.  streams may
+    //      submit from several threads at once, but every submission for a
+    //      frame must be made before the context calls present(), and not
+    //      while it is inside present() or wait().  at
+    //      present the submissions are sent after the commands made
+    //      directly on the context, in order of increasing key, so each bin
+    //      sees the same order whichever thread finished first.  keys
+    //      should be unique within a frame.
+    //
+    // inputs:
+    //      key         - ordering key for this submission
+    n3d_result_e submit(const uint64_t key);
+
 protected:
 
     // hidden implementation
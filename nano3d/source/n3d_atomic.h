@@ -10,14 +10,16 @@ namespace {
 
 #if defined(_MSC_VER)
 
+// note: inc and dec return the value prior to modification
+
 long n3d_atomic_inc(n3d_atomic_t& v)
 {
-    return _InterlockedIncrement(&v);
+    return _InterlockedIncrement(&v) - 1;
 }
 
 long n3d_atomic_dec(n3d_atomic_t& v)
 {
-    return _InterlockedDecrement(&v);
+    return _InterlockedDecrement(&v) + 1;
 }
 
 long n3d_atomic_xchg(n3d_atomic_t& v, long x)
@@ -25,6 +27,15 @@ long n3d_atomic_xchg(n3d_atomic_t& v, long x)
     return _InterlockedExchange(&v, x);
 }
 
+// note: load returns the value and no later reads can move before it
+
+long n3d_atomic_load(const n3d_atomic_t& v)
+{
+    const long o = v;
+    _ReadWriteBarrier();
+    return o;
+}
+
 #else
 
 long n3d_atomic_inc(n3d_atomic_t& v)
@@ -44,6 +55,11 @@ long n3d_atomic_xchg(n3d_atomic_t& v, long x)
     return o;
 }
 
+long n3d_atomic_load(const n3d_atomic_t& v)
+{
+    return __atomic_load_n(&v, __ATOMIC_ACQUIRE);
+}
+
 #endif
 
 } // namespace {}
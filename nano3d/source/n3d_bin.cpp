@@ -1,10 +1,16 @@
+#include <atomic>
+#include <chrono>
 #include <stdio.h>
 
 #include "n3d_bin.h"
 #include "n3d_frame.h"
+#include "n3d_schedule.h"
 
 namespace {
 
+// number of commands a bin takes from its pipe at a time
+static const uint32_t c_pop_batch = 16;
+
 // per frame bin clear
 void bin_clear(n3d_bin_t& bin, uint32_t argb, float depth)
 {
@@ -26,46 +32,98 @@ void bin_clear(n3d_bin_t& bin, uint32_t argb, float depth)
         c += pitch;
     }
 }
-};
 
-// process all pending messages in a bins queue
-void n3d_bin_process(n3d_bin_t* bin)
+// pop the next few commands for a bin.  once the pipe is empty the queued
+// flag is cleared so that the producer will queue the bin again, and then the
+// pipe is checked once more for any commands which raced with clearing the
+// flag.
+uint32_t bin_pop(n3d_bin_t& bin, n3d_command_t* cmd, uint32_t num)
 {
-    n3d_assert(bin);
+    uint32_t got = bin.pipe_.pop_n(cmd, num);
+    if (got) {
+        return got;
+    }
+    n3d_atomic_xchg(bin.queued_, 0);
+    got = bin.pipe_.pop_n(cmd, num);
+    if (!got) {
+        return 0;
+    }
+    // note: the producer may have queued us again already which is fine, as
+    //       whoever takes that entry will find the bin empty or busy.
+    n3d_atomic_xchg(bin.queued_, 1);
+    return got;
+}
 
-    // note: bin_man will acquire the lock when its asked to receive work
-    //       to do.  this lock scope will release the lock after we have
-    //       finished processing the bin.
-    n3d_assert(bin->lock_.atom_ == 1);
-    n3d_scope_spinlock_t guard(bin->lock_, false);
+// process commands until the pipe of a locked bin is empty
+void bin_drain(n3d_bin_t* bin)
+{
     n3d_rasterizer_t::state_t& state = bin->state_;
 
+    // time spent on commands is used by the schedule to balance its workers
+    typedef std::chrono::steady_clock clock_t;
+    clock_t::time_point start;
+    bool timing = false;
+
+    // commands are taken from the pipe a batch at a time
+    n3d_command_t batch[c_pop_batch];
+    uint32_t num = 0, next = 0;
+
     // while there are messages left to process
     while (true) {
 
-        // try to pop a command from the queue
-        n3d_command_t cmd;
-        while (!bin->pipe_.pop(cmd)) {
-            return;
+        // try to pop more commands from the queue
+        if (next == num) {
+            next = 0;
+            num = bin_pop(*bin, batch, c_pop_batch);
+            if (!num) {
+                if (timing) {
+                    const clock_t::duration spent = clock_t::now() - start;
+                    bin->time_ += uint64_t(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(spent).count());
+                }
+                return;
+            }
+        }
+        const n3d_command_t& cmd = batch[next++];
+
+        // only start the clock when there is work so idle polling is free
+        if (!timing) {
+            start = clock_t::now();
+            timing = true;
         }
 
         switch (cmd.command_) {
         case (n3d_command_t::cmd_triangle):
             // rasterize a single triangle
+            ++bin->cost_;
             if (bin->rasterizer_) {
                 n3d_assert(bin->rasterizer_->raster_proc_);
                 bin->rasterizer_->raster_proc_(
                     state,
-                    cmd.triangle_,
+                    *cmd.triangle_,
                     bin->rasterizer_->user_);
             }
             break;
 
+        case (n3d_command_t::cmd_batch):
+            // rasterize the triangles from a batch which overlap this bin
+            bin->cost_ += cmd.batch_.count_;
+            if (bin->rasterizer_) {
+                n3d_assert(bin->rasterizer_->raster_proc_);
+                for (uint32_t i = 0; i < cmd.batch_.count_; ++i) {
+                    bin->rasterizer_->raster_proc_(
+                        state,
+                        cmd.batch_.triangle_[cmd.batch_.index_[i]],
+                        bin->rasterizer_->user_);
+                }
+            }
+            break;
+
         case (n3d_command_t::cmd_present):
             // present working buffer to the screen buffer
-            n3d_atomic_inc(bin->frame_);
             n3d_assert(bin->counter_);
-            n3d_atomic_dec(*bin->counter_);
+            n3d_atomic_dec(bin->counter_[bin->frame_ & 1]);
+            n3d_atomic_inc(bin->frame_);
             break;
 
         case (n3d_command_t::cmd_clear):
@@ -79,6 +137,12 @@ void n3d_bin_process(n3d_bin_t* bin)
             state.texure_ = cmd.texture_;
             break;
 
+        case (n3d_command_t::cmd_target):
+            // draw into a new target at the same offset
+            state.target_[n3d_target_pixel].uint32_ = cmd.target_ +
+                uint32_t(state.offset_.x) + uint32_t(state.offset_.y) * state.pitch_;
+            break;
+
         case (n3d_command_t::cmd_rasterizer):
             // change the rasterizer
             bin->rasterizer_ = cmd.rasterizer_;
@@ -89,3 +153,54 @@ void n3d_bin_process(n3d_bin_t* bin)
         }
     }
 }
+} // namespace {}
+
+// process all pending messages in a bins queue
+void n3d_bin_process(n3d_bin_t* bin)
+{
+    n3d_assert(bin);
+
+    // note: the schedule hands over the bin locked, and it is unlocked once
+    //       processed.  a producer which queued the bin while we held the
+    //       lock had that entry dropped by get_work, so after unlocking the
+    //       bin is processed again if it was queued since.  if another thread
+    //       has locked it by then, that thread makes the same check.
+    n3d_assert(bin->lock_.atom_ == 1);
+    do {
+        bin_drain(bin);
+        bin->lock_.unlock();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    } while (n3d_atomic_load(bin->queued_) && bin->lock_.try_lock());
+}
+
+void n3d_bin_touch(
+    n3d_bin_t* bin)
+{
+    n3d_assert(bin);
+    const n3d_rasterizer_t::state_t& state = bin->state_;
+    float* z = state.target_[n3d_target_depth].float_;
+    if (!z) {
+        return;
+    }
+    for (uint32_t y = 0; y < state.height_; ++y) {
+        for (uint32_t x = 0; x < state.width_; ++x) {
+            z[x] = 0.f;
+        }
+        z += state.pitch_;
+    }
+}
+
+void n3d_bin_send(
+    n3d_bin_t* bin,
+    const n3d_command_t& cmd)
+{
+    n3d_assert(bin && bin->schedule_);
+    bin->pipe_.push(cmd);
+    // note: the push is only a release so fence before reading the flag, or
+    //       this could miss the consumer clearing it after finding the pipe
+    //       empty.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!bin->queued_ && !n3d_atomic_xchg(bin->queued_, 1)) {
+        bin->schedule_->ready(bin);
+    }
+}
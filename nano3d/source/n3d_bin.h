@@ -10,16 +10,27 @@ struct n3d_command_t {
 
     enum {
         cmd_triangle,
+        // triangles from a front end batch
+        cmd_batch,
         cmd_rasterizer,
         cmd_texture,
         cmd_present,
         cmd_clear,
+        // switch to a new render target of the same size
+        cmd_target,
         // custom user data to be passed to the rasterizer
         cmd_user_data,
     } command_;
 
+    // note: triangles are referenced rather than copied to keep commands
+    //       small, so they must outlive the frame they are sent in.
     union {
-        n3d_rasterizer_t::triangle_t triangle_;
+        const n3d_rasterizer_t::triangle_t* triangle_;
+        struct {
+            const n3d_rasterizer_t::triangle_t* triangle_;
+            const uint32_t* index_;
+            uint32_t count_;
+        } batch_;
         const n3d_rasterizer_t* rasterizer_;
         const n3d_texture_t* texture_;
         struct {
@@ -27,10 +38,14 @@ struct n3d_command_t {
             float depth_;
         } clear_;
         n3d_user_data_t user_data_;
+        uint32_t* target_;
     };
 };
 
-typedef n3d_pipe_t<n3d_command_t, 1024> n3d_command_pipe_t;
+// bins queue commands in chunks taken from a pool shared by the frame, so the
+// front end can always append however far ahead of the bins it gets.
+typedef n3d_chunk_pipe_t<n3d_command_t, 256> n3d_command_pipe_t;
+typedef n3d_command_pipe_t::pool_t n3d_command_pool_t;
 
 struct n3d_bin_t {
 
@@ -38,6 +53,12 @@ struct n3d_bin_t {
         : pipe_()
         , rasterizer_(nullptr)
         , counter_(nullptr)
+        , cost_(0)
+        , active_(true)
+        , time_(0)
+        , owner_(0)
+        , schedule_(nullptr)
+        , queued_(0)
     {
         state_.target_[n3d_target_pixel].uint32_ = nullptr;
         state_.target_[n3d_target_depth].float_  = nullptr;
@@ -63,15 +84,48 @@ struct n3d_bin_t {
     // the current frame number
     n3d_atomic_t frame_;
 
-    // this counter is shared amongst all bins and tracks the number which are
-    // still to present for this frame.  it is decremented when this bin
-    // presents.
+    // a pair of counters shared amongst all bins which track the number still
+    // to present the last even and odd numbered frames, so that the next
+    // frame can be started before the last is finished.  the one for this
+    // frame is decremented when this bin presents.
     n3d_atomic_t* counter_;
 
+    // number of triangles rasterized since the frame last rebalanced
+    uint32_t cost_;
+
+    // set while this bin covers part of the frame.  the quadrant bins of a
+    // cell are only active while it is split.
+    bool active_;
+
+    // nanoseconds spent processing commands since the schedule last
+    // balanced its workers
+    uint64_t time_;
+
+    // worker slot which looks after this bin, other threads only take it
+    // when they have none of their own to process
+    uint32_t owner_;
+
+    // the schedule which this bin is queued with when it has commands
+    n3d_schedule_t* schedule_;
+
+    // set while the bin is queued with its schedule or being processed, so
+    // that the producer only queues it when it goes from idle to busy
+    n3d_atomic_t queued_;
+
     // unique bin id
-    uint16_t id_;
+    uint32_t id_;
 };
 
 // process all work pending for a bin
 void n3d_bin_process(
     n3d_bin_t* bin);
+
+// write to the depth plane of a bin so that its memory is first touched by,
+// and so placed on the numa node of, the calling thread
+void n3d_bin_touch(
+    n3d_bin_t* bin);
+
+// send a command to a bin, queueing it with its schedule if it was idle
+void n3d_bin_send(
+    n3d_bin_t* bin,
+    const n3d_command_t& cmd);
@@ -0,0 +1,138 @@
+// n3d_cpu.cpp
+//   runtime cpu feature and topology detection
+
+#include <stdio.h>
+#include <thread>
+
+#include "n3d_cpu.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+namespace {
+
+uint32_t detect()
+{
+    uint32_t out = 0;
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int max_leaf = info[0];
+
+    __cpuid(info, 1);
+    out |= (info[3] & (1 << 26)) ? n3d_cpu_sse2 : 0;
+    out |= (info[2] & (1 << 19)) ? n3d_cpu_sse41 : 0;
+
+    // avx state must also be enabled by the os
+    const bool os_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) &&
+                        ((_xgetbv(0) & 0x6) == 0x6);
+    if (os_avx && max_leaf >= 7) {
+        __cpuidex(info, 7, 0);
+        out |= (info[1] & (1 << 5)) ? n3d_cpu_avx2 : 0;
+    }
+#else
+    __builtin_cpu_init();
+    out |= __builtin_cpu_supports("sse2") ? n3d_cpu_sse2 : 0;
+    out |= __builtin_cpu_supports("sse4.1") ? n3d_cpu_sse41 : 0;
+    out |= __builtin_cpu_supports("avx2") ? n3d_cpu_avx2 : 0;
+#endif
+    return out;
+}
+
+#if defined(__linux__)
+// parse a sysfs cpu or node list such as "0-3,8-11"
+void parse_list(const char* path, std::vector<uint32_t>& out)
+{
+    FILE* fd = fopen(path, "r");
+    if (!fd) {
+        return;
+    }
+    unsigned lo = 0, hi = 0;
+    while (fscanf(fd, "%u", &lo) == 1) {
+        hi = lo;
+        int c = fgetc(fd);
+        if (c == '-') {
+            if (fscanf(fd, "%u", &hi) != 1)
+                break;
+            c = fgetc(fd);
+        }
+        for (unsigned i = lo; i <= hi; ++i) {
+            out.push_back(i);
+        }
+        if (c != ',')
+            break;
+    }
+    fclose(fd);
+}
+#endif
+
+} // namespace {}
+
+uint32_t n3d_cpu_features()
+{
+    // only query the cpu once
+    static const uint32_t features = detect();
+    return features;
+}
+
+void n3d_cpu_nodes(std::vector<std::vector<uint32_t>>& nodes)
+{
+    nodes.clear();
+#if defined(_MSC_VER)
+    ULONG highest = 0;
+    if (GetNumaHighestNodeNumber(&highest)) {
+        for (ULONG node = 0; node <= highest; ++node) {
+            // note: only the first processor group is considered
+            ULONGLONG mask = 0;
+            if (!GetNumaNodeProcessorMask(UCHAR(node), &mask) || !mask)
+                continue;
+            nodes.emplace_back();
+            for (uint32_t i = 0; i < 64; ++i) {
+                if (mask & (1ull << i)) {
+                    nodes.back().push_back(i);
+                }
+            }
+        }
+    }
+#elif defined(__linux__)
+    // cpus we are allowed to run on, which may be limited by a container
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const bool masked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    // node numbers may have gaps, and memory only nodes have no cpus
+    std::vector<uint32_t> online;
+    parse_list("/sys/devices/system/node/online", online);
+    for (uint32_t node : online) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+        std::vector<uint32_t> cpus;
+        parse_list(path, cpus);
+        if (cpus.empty())
+            continue;
+        nodes.emplace_back();
+        for (uint32_t cpu : cpus) {
+            if (!masked || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) {
+                nodes.back().push_back(cpu);
+            }
+        }
+        if (nodes.back().empty()) {
+            nodes.pop_back();
+        }
+    }
+#endif
+    // fall back to a single node
+    if (nodes.empty()) {
+        const uint32_t count = std::thread::hardware_concurrency();
+        nodes.emplace_back();
+        for (uint32_t i = 0; i < (count ? count : 1); ++i) {
+            nodes.back().push_back(i);
+        }
+    }
+}
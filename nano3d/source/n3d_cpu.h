@@ -0,0 +1,29 @@
+#pragma once
+// n3d_cpu.h
+//   runtime cpu feature detection
+
+#include <stdint.h>
+#include <vector>
+
+// mark a function as being compiled for avx2 so that it can be built without
+// enabling avx2 for the whole project.  it must only be called after checking
+// n3d_cpu_features() at runtime.
+#if defined(_MSC_VER)
+#define N3D_TARGET_AVX2
+#else
+#define N3D_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// cpu features that nano3d can take advantage of
+enum n3d_cpu_feature_e {
+    n3d_cpu_sse2  = 0x01,
+    n3d_cpu_sse41 = 0x02,
+    n3d_cpu_avx2  = 0x04,
+};
+
+// return a mask of n3d_cpu_feature_e supported by the host cpu and os
+uint32_t n3d_cpu_features();
+
+// list the logical cpus this process may run on, grouped by numa node.  if
+// the topology cant be found all cpus are placed in a single node.
+void n3d_cpu_nodes(std::vector<std::vector<uint32_t>>& nodes);
@@ -3,8 +3,12 @@
 // nano3d forward declarations
 
 struct nano3d_t;
+struct n3d_stream_t;
 
 struct n3d_vertex_buffer_t;
+struct n3d_bounds_t;
+struct n3d_stats_t;
+struct n3d_settings_t;
 struct n3d_texture_t;
 struct n3d_target_t;
 struct n3d_rasterizer_t;
@@ -14,6 +18,7 @@ struct n3d_thread_t;
 struct n3d_command_t;
 struct n3d_bin_t;
 struct n3d_schedule_t;
+struct n3d_task_set_t;
 
 struct n3d_triangle_stack_t;
 struct n3d_framebuffer_t;
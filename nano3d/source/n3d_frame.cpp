@@ -1,6 +1,8 @@
 // n3d_frame.cpp
 //   implement nano3d framebuffer and bin processor
 
+#include <limits>
+#include <math.h>
 #include <stdio.h>
 
 #include "n3d_bin.h"
@@ -8,22 +10,25 @@
 
 namespace {
 
+// limits for the automatic bin size
+static const uint32_t c_bin_size_min = 32;
+static const uint32_t c_bin_size_max = 128;
+// number of bins the automatic size aims to give each thread
+static const uint32_t c_bins_per_thread = 8;
+// fewest triangles a cell must rasterize in a frame before it is split
+static const uint32_t c_split_min = 256;
+
 // send a message to a single bin
 void send_one(
+    n3d_framebuffer_t* frame,
     n3d_bin_t* bin,
     n3d_command_t& cmd)
 {
     n3d_assert(bin);
-    while (!bin->pipe_.push(cmd)) {
-
-        //todo: at this stage we could switch to the bin and give it some
-        //      execution time until the bin is empty again or less full.
-
-        //note: if there is no other thread to consume commands then at
-        //      this stage we will deadlock.
-
-        n3d_yield();
-    }
+    ++frame->sent_;
+    // note: the pipe grows as needed so this never blocks.  the api keeps
+    //       the memory used in check by draining bins when over budget.
+    n3d_bin_send(bin, cmd);
 }
 
 // send a message to all bins
@@ -32,77 +37,309 @@ void send_all(
     n3d_command_t& cmd)
 {
     n3d_assert(frame);
-    for (std::unique_ptr<n3d_bin_t>& bin : frame->bin_) {
-        send_one(bin.get(), cmd);
+    for (n3d_bin_t* bin : frame->active_) {
+        send_one(frame, bin, cmd);
+    }
+}
+
+// range of bins that a triangle may overlap, inclusive
+struct bin_range_t {
+    int32_t x0, y0, x1, y1;
+};
+
+// find the range of bins which a triangle may overlap directly from its
+// bounds, so binning cost scales with the triangle and not the frame size.
+// a bin is overlapped when its left edge is not past max+1 and its right edge
+// is not before min.
+bool bin_range(
+    const n3d_framebuffer_t* frame,
+    const n3d_rasterizer_t::triangle_t& triangle,
+    bin_range_t& out)
+{
+    const float bw = float(frame->bin_w_);
+    const float bh = float(frame->bin_h_);
+    const float x0 = ceilf(triangle.min_.x / bw) - 1.f;
+    const float y0 = ceilf(triangle.min_.y / bh) - 1.f;
+    const float x1 = floorf((triangle.max_.x + 1.f) / bw);
+    const float y1 = floorf((triangle.max_.y + 1.f) / bh);
+    // reject triangles which are off the frame, before converting to int so
+    // that huge bounds cant overflow.
+    const float nx = float(frame->bins_x_ - 1);
+    const float ny = float(frame->bins_y_ - 1);
+    if (x0 > nx || y0 > ny || x1 < 0.f || y1 < 0.f)
+        return false;
+    out.x0 = int32_t(max2(x0, 0.f));
+    out.y0 = int32_t(max2(y0, 0.f));
+    out.x1 = int32_t(min2(x1, nx));
+    out.y1 = int32_t(min2(y1, ny));
+    return out.x0 <= out.x1 && out.y0 <= out.y1;
+}
+
+// exact triangle and bin overlap test using the triangle edge functions.  for
+// each edge the bin corner which is most inside is tested, and if it is
+// outside then so is the whole bin.
+struct edge_test_t {
+
+    edge_test_t(
+        const n3d_framebuffer_t* frame,
+        const n3d_rasterizer_t::triangle_t& triangle)
+    {
+        const float bw = float(frame->bin_w_);
+        const float bh = float(frame->bin_h_);
+        for (uint32_t i = 0; i < 3; ++i) {
+            const float sx = triangle.sx_[e_attr_b0 + i];
+            const float sy = triangle.sy_[e_attr_b0 + i];
+            // pick the corner offset for this edge and grow the bin by a
+            // pixel on each side so that rounding in the rasterizers edge
+            // stepping can never make us drop a covered pixel.
+            const float cx = (sx > 0.f) ? bw : -1.f;
+            const float cy = (sy > 0.f) ? bh : -1.f;
+            v_[i] = triangle.v_[e_attr_b0 + i] + sx * cx + sy * cy;
+            sx_[i] = sx * bw;
+            sy_[i] = sy * bh;
+        }
+    }
+
+    // test if the triangle overlaps the bin at this grid location
+    bool overlaps(const int32_t x, const int32_t y) const
+    {
+        const float fx = float(x), fy = float(y);
+        for (uint32_t i = 0; i < 3; ++i) {
+            if ((v_[i] + sx_[i] * fx + sy_[i] * fy) < 0.f)
+                return false;
+        }
+        return true;
     }
+
+    // edge values at the bin corner for bin [0,0], and their step per bin
+    float v_[3], sx_[3], sy_[3];
+};
+
+// point a bin at a rectangle of the render target
+void bin_place(
+    n3d_framebuffer_t* frame,
+    n3d_bin_t& bin,
+    const uint32_t x,
+    const uint32_t y,
+    const uint32_t w,
+    const uint32_t h)
+{
+    auto& state = bin.state_;
+    const n3d_target_t& target = frame->target_;
+
+    // frame buffer dimensions
+    state.width_  = w;
+    state.height_ = h;
+    state.pitch_  = target.width_;
+
+    // bin screen space location
+    state.offset_.x = float(x);
+    state.offset_.y = float(y);
+
+    // linear bin offset from screen origin [0,0]
+    const uint32_t fboffs = x + y * target.width_;
+
+    // render target state
+    state.target_[n3d_target_depth].float_  = fboffs + frame->depth_.get();
+    // xxx: check for aligned bin start
+    state.target_[n3d_target_pixel].uint32_ = fboffs + target.pixels_;
+    state.target_[n3d_target_aux_1].uint32_ = nullptr;
+    state.target_[n3d_target_aux_2].uint32_ = nullptr;
+}
+
+// point a bin at one quadrant of a cell, stored in rows
+void quadrant_place(
+    n3d_framebuffer_t* frame,
+    const n3d_cell_t& cell,
+    const uint32_t q)
+{
+    n3d_assert(cell.split_w_ && q < 4);
+    const uint32_t qx = q & 1, qy = q >> 1;
+    bin_place(
+        frame,
+        *cell.bin_[q],
+        cell.x_ + (qx ? cell.split_w_ : 0),
+        cell.y_ + (qy ? cell.split_h_ : 0),
+        qx ? cell.w_ - cell.split_w_ : cell.split_w_,
+        qy ? cell.h_ - cell.split_h_ : cell.split_h_);
+}
+
+// visit the bins of a cell which a triangle may overlap.  a quadrant is
+// overlapped when its left edge is not past max+1 and its right edge is not
+// before min, as with bin_range.
+template <typename func_t>
+void cell_bins(
+    const n3d_cell_t& cell,
+    const n3d_rasterizer_t::triangle_t& triangle,
+    func_t func)
+{
+    if (!cell.split_) {
+        func(cell.bin_[0]);
+        return;
+    }
+    const float x[3] = {
+        float(cell.x_), float(cell.x_ + cell.split_w_), float(cell.x_ + cell.w_) };
+    const float y[3] = {
+        float(cell.y_), float(cell.y_ + cell.split_h_), float(cell.y_ + cell.h_) };
+    for (uint32_t q = 0; q < 4; ++q) {
+        const uint32_t qx = q & 1, qy = q >> 1;
+        if (x[qx] > triangle.max_.x + 1.f || x[qx + 1] < triangle.min_.x)
+            continue;
+        if (y[qy] > triangle.max_.y + 1.f || y[qy + 1] < triangle.min_.y)
+            continue;
+        func(cell.bin_[q]);
+    }
+}
+
+// split or merge a cell.  all bins must be idle.
+void cell_split(
+    n3d_framebuffer_t* frame,
+    n3d_cell_t& cell,
+    const bool split)
+{
+    n3d_assert(cell.split_ != split);
+    n3d_bin_t& first = *cell.bin_[0];
+    {
+        n3d_scope_spinlock_t guard(first.lock_);
+        if (split) {
+            quadrant_place(frame, cell, 0);
+        } else {
+            bin_place(frame, first, cell.x_, cell.y_, cell.w_, cell.h_);
+        }
+    }
+    // the other quadrants have missed the state sent while they were idle
+    // so bring them up to date with the first
+    for (uint32_t q = 1; q < 4; ++q) {
+        n3d_bin_t& bin = *cell.bin_[q];
+        n3d_scope_spinlock_t guard(bin.lock_);
+        if (split) {
+            quadrant_place(frame, cell, q);
+        }
+        bin.rasterizer_ = first.rasterizer_;
+        bin.state_.texure_ = first.state_.texure_;
+        bin.frame_ = first.frame_;
+        bin.owner_ = first.owner_;
+        bin.active_ = split;
+    }
+    cell.split_ = split;
 }
 
 } // namespace {}
 
+void n3d_frame_bin_size(
+    const n3d_target_t* framebuffer,
+    const uint32_t num_threads,
+    uint32_t& bin_w,
+    uint32_t& bin_h)
+{
+    n3d_assert(framebuffer);
+    // larger bins make binning cheaper but there must be enough of them to
+    // share out between the threads, so halve the size until there are.
+    const uint32_t wanted = c_bins_per_thread * (num_threads + 1);
+    uint32_t size = c_bin_size_max;
+    while (size > c_bin_size_min) {
+        const uint32_t bx = (framebuffer->width_ + size - 1) / size;
+        const uint32_t by = (framebuffer->height_ + size - 1) / size;
+        if (bx * by >= wanted)
+            break;
+        size /= 2;
+    }
+    bin_w = size;
+    bin_h = size;
+}
+
 // create a new framebuffer
 bool n3d_frame_create(
     n3d_framebuffer_t* frame,
-    const n3d_target_t* framebuffer)
+    const n3d_target_t* framebuffer,
+    const uint32_t bin_width,
+    const uint32_t bin_height)
 {
-    const uint32_t bin_w = 64, bin_h = 64;
+    n3d_assert(bin_width && bin_height);
+
+    // rasterizers align their spans to 16 pixels from the bin origin
+    const uint32_t bin_w = (bin_width + 15) & ~15u;
+    const uint32_t bin_h = bin_height;
 
     const uint32_t fb_width = framebuffer->width_;
     const uint32_t fb_height = framebuffer->height_;
 
-    //todo: dont simply round down and crop since we will get inactive borders
-    //      around the framebuffer.
-
-    const int bx = fb_width / bin_w;
-    const int by = fb_height / bin_h;
+    // round up so that partial bins cover the right and bottom edges
+    const int bx = (fb_width + bin_w - 1) / bin_w;
+    const int by = (fb_height + bin_h - 1) / bin_h;
     const int nbins = bx * by;
     n3d_assert(nbins > 0);
 
-    // allocate a new depth buffer
+    frame->bin_w_ = bin_w;
+    frame->bin_h_ = bin_h;
+    frame->bins_x_ = bx;
+    frame->bins_y_ = by;
+
+    // allocate a new depth buffer.  it is left uninitialized so that its
+    // pages are first touched by the worker which owns each bin.
     // xxx: this needs to be an aligned alloc
     frame->depth_.reset(new float[fb_width * fb_height]);
-    float* depth = frame->depth_.get();
-    n3d_assert(depth);
+    n3d_assert(frame->depth_.get());
+
+    frame->target_ = *framebuffer;
 
-    // for each bin in this framebuffer
+    // each cell has a bin of its own plus three more for when it is split
     auto& bins = frame->bin_;
-    bins.reserve(nbins);
-    for (int i = 0; i < nbins; ++i) {
+    bins.reserve(nbins * 4);
+    for (int i = 0; i < nbins * 4; ++i) {
 
         frame->bin_.emplace_back();
         frame->bin_.back().reset(new n3d_bin_t);
         n3d_assert(frame->bin_.back().get());
         n3d_bin_t& bin = *(frame->bin_.back().get());
-        auto& state = bin.state_;
 
-        // set bin id
+        // set bin id.  ids index the per bin triangle lists of a batch, so
+        // they must not wrap however many bins there are.
+        n3d_assert(frame->bin_.size() - 1 <=
+                   std::numeric_limits<decltype(bin.id_)>::max());
         bin.id_ = i;
 
-        // frame buffer dimensions
-        state.width_  = bin_w;
-        state.height_ = bin_h;
-        state.pitch_  = framebuffer->width_;
-
-        // bin integer screen space location
-        uint32_t iox = (i % bx) * bin_w;
-        uint32_t ioy = (i / bx) * bin_w;
-
-        // bin screen space location
-        state.offset_.x = float(iox);
-        state.offset_.y = float(ioy);
-
-        // linear bin offset from screen origin [0,0]
-        uint32_t fboffs = +iox + ioy * framebuffer->width_;
-
-        // render target state
-        state.target_[n3d_target_depth].float_  = fboffs + depth;
-        // xxx: check for aligned bin start
-        state.target_[n3d_target_pixel].uint32_ = fboffs + framebuffer->pixels_;
-        state.target_[n3d_target_aux_1].uint32_ = nullptr;
-        state.target_[n3d_target_aux_2].uint32_ = nullptr;
-        state.texure_ = nullptr;
-
+        bin.state_.texure_ = nullptr;
         bin.rasterizer_ = nullptr;
         bin.frame_ = 0;
+        bin.active_ = i < nbins;
+        bin.pipe_.init(&frame->command_);
+    }
+
+    // for each cell in this framebuffer
+    frame->cell_.resize(nbins);
+    frame->active_.clear();
+    for (int i = 0; i < nbins; ++i) {
+
+        n3d_cell_t& cell = frame->cell_[i];
+        cell.bin_[0] = bins[i].get();
+        for (uint32_t q = 1; q < 4; ++q) {
+            cell.bin_[q] = bins[nbins + i * 3 + (q - 1)].get();
+        }
+
+        // cell integer screen space location, cropped for cells on the edges
+        cell.x_ = (i % bx) * bin_w;
+        cell.y_ = (i / bx) * bin_h;
+        cell.w_ = min2(bin_w, fb_width - cell.x_);
+        cell.h_ = min2(bin_h, fb_height - cell.y_);
+
+        // quadrants keep the 16 pixel alignment across
+        cell.split_w_ = ((cell.w_ / 2) + 15) & ~15u;
+        cell.split_h_ = cell.h_ / 2;
+        if (cell.split_w_ >= cell.w_ || cell.split_h_ == 0) {
+            cell.split_w_ = 0;
+            cell.split_h_ = 0;
+        }
+        cell.split_ = false;
+
+        // the first bin covers the whole cell until it is split
+        bin_place(frame, *cell.bin_[0], cell.x_, cell.y_, cell.w_, cell.h_);
+        if (cell.split_w_) {
+            for (uint32_t q = 1; q < 4; ++q) {
+                quadrant_place(frame, cell, q);
+            }
+        }
+        frame->active_.push_back(cell.bin_[0]);
     }
 
     return true;
@@ -112,6 +349,8 @@ void n3d_frame_free(n3d_framebuffer_t* frame)
 {
     n3d_assert(frame);
     frame->depth_.release();
+    frame->active_.clear();
+    frame->cell_.clear();
     frame->bin_.clear();
 }
 
@@ -121,34 +360,138 @@ void n3d_frame_send_triangle(
 {
     n3d_assert(frame);
 
+    // visit only the bins under the triangle bounds
+    bin_range_t r;
+    if (!bin_range(frame, triangle, r))
+        return;
+
+    // write the triangle once and send the bins a reference to it
+    n3d_rasterizer_t::triangle_t& stored =
+        frame->data_[frame->current_].triangle_.next();
+    stored = triangle;
     n3d_command_t cmd;
     cmd.command_ = cmd.cmd_triangle;
-    cmd.triangle_ = triangle;
+    cmd.triangle_ = &stored;
+    const edge_test_t edge(frame, triangle);
+    const bool single = (r.x0 == r.x1) && (r.y0 == r.y1);
+    for (int32_t y = r.y0; y <= r.y1; ++y) {
+        for (int32_t x = r.x0; x <= r.x1; ++x) {
+            // skip bins which the triangle edges miss
+            if (!single && !edge.overlaps(x, y))
+                continue;
+            // send this triangle to the bins covering the cell
+            const n3d_cell_t& cell = frame->cell_[x + y * frame->bins_x_];
+            cell_bins(cell, triangle, [&](n3d_bin_t* bin) {
+                send_one(frame, bin, cmd);
+            });
+        }
+    }
+}
 
-    //note: if we are pushing commands into a command queue we need to be sure
-    //      that there is some way to consume those commands in case that the
-    //      queue is full, as we would block forever.
+n3d_batch_t* n3d_frame_batch_new(
+    n3d_framebuffer_t* frame)
+{
+    n3d_assert(frame);
+    n3d_batch_t* batch = nullptr;
+    {
+        n3d_scope_spinlock_t guard(frame->batch_lock_);
+        n3d_frame_data_t& data = frame->data_[frame->current_];
+        auto& pool = data.batch_;
+        if (data.batch_used_ >= pool.size()) {
+            pool.emplace_back(new n3d_batch_t);
+        }
+        batch = pool[data.batch_used_++].get();
+    }
+    n3d_assert(batch);
 
-    // iterate over all bins
-    for (uint32_t i = 0; i < frame->bin_.size(); ++i) {
-        n3d_bin_t& bin = *(frame->bin_[i]);
-        auto& state = bin.state_;
+    // empty the batch but keep its storage around
+    batch->triangle_.clear();
+    batch->bin_.resize(frame->bin_.size());
+    for (auto& list : batch->bin_) {
+        list.clear();
+    }
+    return batch;
+}
 
-        // reject when triangle cant overlap the bin
-        if (state.offset_.x > (triangle.max_.x + 1.f))
-            continue;
-        if (state.offset_.y > (triangle.max_.y + 1.f))
-            continue;
-        if ((state.offset_.x + state.width_) < triangle.min_.x)
-            continue;
-        if ((state.offset_.y + state.height_) < triangle.min_.y)
-            continue;
+void n3d_frame_batch_triangle(
+    const n3d_framebuffer_t* frame,
+    n3d_batch_t* batch,
+    const n3d_rasterizer_t::triangle_t& triangle)
+{
+    n3d_assert(frame && batch);
+
+    bin_range_t r;
+    if (!bin_range(frame, triangle, r))
+        return;
+    const uint32_t index = uint32_t(batch->triangle_.size());
+
+    // a triangle whose bounds fit in one cell must overlap it
+    if ((r.x0 == r.x1) && (r.y0 == r.y1)) {
+        const n3d_cell_t& cell = frame->cell_[r.x0 + r.y0 * frame->bins_x_];
+        cell_bins(cell, triangle, [&](n3d_bin_t* bin) {
+            batch->bin_[bin->id_].push_back(index);
+        });
+        batch->triangle_.push_back(triangle);
+        return;
+    }
 
-        // send this triangle to the bin
-        send_one(&bin, cmd);
+    // visit only the bins under the triangle bounds which its edges touch
+    const edge_test_t edge(frame, triangle);
+    bool used = false;
+    for (int32_t y = r.y0; y <= r.y1; ++y) {
+        for (int32_t x = r.x0; x <= r.x1; ++x) {
+            if (!edge.overlaps(x, y))
+                continue;
+            const n3d_cell_t& cell = frame->cell_[x + y * frame->bins_x_];
+            cell_bins(cell, triangle, [&](n3d_bin_t* bin) {
+                batch->bin_[bin->id_].push_back(index);
+                used = true;
+            });
+        }
+    }
+
+    // only keep triangles which landed in a bin
+    if (used) {
+        batch->triangle_.push_back(triangle);
+    }
+}
+
+void n3d_frame_send_batch(
+    n3d_framebuffer_t* frame,
+    const n3d_batch_t* batch)
+{
+    n3d_assert(frame && batch);
+    n3d_assert(batch->bin_.size() == frame->bin_.size());
+
+    // nothing to do if every triangle was culled
+    if (batch->triangle_.empty())
+        return;
+
+    n3d_command_t cmd;
+    cmd.command_ = cmd.cmd_batch;
+    cmd.batch_.triangle_ = batch->triangle_.data();
+
+    for (uint32_t i = 0; i < frame->bin_.size(); ++i) {
+        const auto& list = batch->bin_[i];
+        if (list.empty())
+            continue;
+        cmd.batch_.index_ = list.data();
+        cmd.batch_.count_ = uint32_t(list.size());
+        send_one(frame, frame->bin_[i].get(), cmd);
     }
 }
 
+void n3d_frame_next(
+    n3d_framebuffer_t* frame)
+{
+    n3d_assert(frame);
+    frame->current_ ^= 1;
+    n3d_frame_data_t& data = frame->data_[frame->current_];
+    data.batch_used_ = 0;
+    data.triangle_.clear();
+    frame->sent_ = 0;
+}
+
 void n3d_frame_send_texture(
     n3d_framebuffer_t* frame,
     const n3d_texture_t* texture)
@@ -188,6 +531,29 @@ void n3d_frame_present(n3d_framebuffer_t* frame)
     send_all(frame, cmd);
 }
 
+void n3d_frame_send_target(
+    n3d_framebuffer_t* frame,
+    const n3d_target_t* target)
+{
+    n3d_assert(frame && target);
+    n3d_assert(target->width_ == frame->target_.width_);
+    n3d_assert(target->height_ == frame->target_.height_);
+    // bins placed from now on will use the new target
+    frame->target_.pixels_ = target->pixels_;
+
+    n3d_command_t cmd;
+    cmd.command_ = cmd.cmd_target;
+    cmd.target_ = target->pixels_;
+    send_all(frame, cmd);
+}
+
+size_t n3d_frame_command_bytes(
+    const n3d_framebuffer_t* frame)
+{
+    n3d_assert(frame);
+    return size_t(frame->command_.used()) * n3d_command_pool_t::chunk_bytes();
+}
+
 void n3d_frame_send_user_data(
     n3d_framebuffer_t* frame,
     const n3d_user_data_t* user_data)
@@ -196,3 +562,55 @@ void n3d_frame_send_user_data(
     cmd.command_ = cmd.cmd_user_data;
     cmd.user_data_ = *user_data;
 }
+
+bool n3d_frame_rebalance(
+    n3d_framebuffer_t* frame,
+    const uint32_t num_threads)
+{
+    n3d_assert(frame);
+
+    // each thread should get an even share of last frames triangles
+    uint64_t total = 0;
+    for (n3d_bin_t* bin : frame->active_) {
+        total += bin->cost_;
+    }
+    const uint64_t share = total / (num_threads + 1);
+
+    bool changed = false;
+    for (n3d_cell_t& cell : frame->cell_) {
+        uint64_t cost = 0;
+        for (uint32_t q = 0; q < (cell.split_ ? 4u : 1u); ++q) {
+            cost += cell.bin_[q]->cost_;
+        }
+        // split cells taking more than half a share, so that one cell cant
+        // hold up the frame, and merge them again once they fall well below.
+        // there is nothing to gain without any worker threads.
+        bool split = cell.split_;
+        if (!num_threads || !cell.split_w_) {
+            split = false;
+        } else if (!split) {
+            split = cost >= c_split_min && cost * 2 > share;
+        } else {
+            split = cost * 8 >= share;
+        }
+        if (split != cell.split_) {
+            cell_split(frame, cell, split);
+            changed = true;
+        }
+    }
+
+    for (std::unique_ptr<n3d_bin_t>& bin : frame->bin_) {
+        bin->cost_ = 0;
+    }
+
+    // list the bins now covering the frame
+    if (changed) {
+        frame->active_.clear();
+        for (n3d_cell_t& cell : frame->cell_) {
+            for (uint32_t q = 0; q < (cell.split_ ? 4u : 1u); ++q) {
+                frame->active_.push_back(cell.bin_[q]);
+            }
+        }
+    }
+    return changed;
+}
@@ -1,7 +1,9 @@
 #pragma once
+#include <array>
 #include <memory>
 #include <vector>
 
+#include "n3d_bin.h"
 #include "n3d_thread.h"
 #include "n3d_types.h"
 #include "nano3d.h"
@@ -11,20 +13,159 @@
 // relaying commands from the frontend interface to the individual bin command
 // queues.
 
+// a batch of triangles which have been set up and binned by the front end.
+// batches can be filled in parallel and are then sent to the bins in order.
+// a batch must not be changed after it has been sent as the bins will refer
+// to its contents until the frame has been presented.
+struct n3d_batch_t {
+    // set up triangles
+    std::vector<n3d_rasterizer_t::triangle_t> triangle_;
+    // indices of the triangles overlapping each bin
+    std::vector<std::vector<uint32_t>> bin_;
+};
+
+// per frame arena of set up triangles.  each triangle is written here once
+// and the bins it overlaps are sent a pointer to it, which remains valid until
+// the frame has been presented and the arena is cleared.
+struct n3d_triangle_stack_t {
+
+    typedef n3d_rasterizer_t::triangle_t triangle_t;
+
+    n3d_triangle_stack_t()
+        : head_(0)
+    {
+    }
+
+    // allocate the next triangle, growing by a block when full.  blocks are
+    // never moved so earlier triangles keep their address.
+    triangle_t& next()
+    {
+        const uint32_t block = head_ / c_block_size;
+        if (block >= block_.size()) {
+            block_.emplace_back(new triangle_t[c_block_size]);
+        }
+        return block_[block][head_++ % c_block_size];
+    }
+
+    // release all triangles but keep the blocks around for the next frame
+    void clear()
+    {
+        head_ = 0;
+    }
+
+protected:
+    static const uint32_t c_block_size = 1024;
+
+    std::vector<std::unique_ptr<triangle_t[]>> block_;
+    uint32_t head_;
+};
+
+// triangles and batches which the bins refer to until a frame is complete.
+// the frame holds two so the next frame can be binned while the bins are
+// still rasterizing the last.
+struct n3d_frame_data_t {
+
+    n3d_frame_data_t()
+        : batch_used_(0)
+    {
+    }
+
+    // triangles sent individually this frame
+    n3d_triangle_stack_t triangle_;
+
+    // pool of triangle batches
+    std::vector<std::unique_ptr<n3d_batch_t>> batch_;
+    // number of batches in use this frame
+    uint32_t batch_used_;
+};
+
+// a cell of the bin grid.  a cell is normally covered by a single bin, but a
+// cell holding a large share of the frame can be split so that a bin covers
+// each of its quadrants, letting several threads rasterize it at once.
+struct n3d_cell_t {
+
+    n3d_cell_t()
+        : bin_()
+        , x_(0)
+        , y_(0)
+        , w_(0)
+        , h_(0)
+        , split_w_(0)
+        , split_h_(0)
+        , split_(false)
+    {
+    }
+
+    // quadrant bins in rows, only the first is used when not split
+    std::array<n3d_bin_t*, 4> bin_;
+    // cell location and size in pixels
+    uint32_t x_, y_, w_, h_;
+    // size of the top left quadrant, zero if the cell is too small to split
+    uint32_t split_w_, split_h_;
+    bool split_;
+};
+
 struct n3d_framebuffer_t {
-    // bins assigned to this frame
+
+    n3d_framebuffer_t()
+        : bin_w_(0)
+        , bin_h_(0)
+        , bins_x_(0)
+        , bins_y_(0)
+        , target_()
+        , data_()
+        , current_(0)
+        , sent_(0)
+    {
+    }
+
+    // chunks for the bin command pipes
+    n3d_command_pool_t command_;
+
+    // all bins owned by this frame.  the first bin of each cell comes first
+    // in rows, followed by the quadrant bins used when cells are split.
     std::vector<std::unique_ptr<n3d_bin_t>> bin_;
-    // XXX: track the n3d_target_t here?
+    // bins currently covering the frame
+    std::vector<n3d_bin_t*> active_;
+    // the bin grid, stored in rows
+    std::vector<n3d_cell_t> cell_;
+    // size of each cell in pixels
+    uint32_t bin_w_, bin_h_;
+    // number of cells across and down the frame
+    uint32_t bins_x_, bins_y_;
+    // the render target
+    n3d_target_t target_;
 
     // the depth buffer plane
     std::unique_ptr<float[]> depth_;
+
+    // triangles and batches for this frame and the one before it
+    std::array<n3d_frame_data_t, 2> data_;
+    // guards taking batches, which streams may do from any thread
+    n3d_spinlock_t batch_lock_;
+    // index of the data used by this frame
+    uint32_t current_;
+
+    // number of commands sent to the bins since the last present
+    uint32_t sent_;
 };
 
 // abstrations for frame commands
 
+// pick a bin size for a target which suits the number of worker threads
+void n3d_frame_bin_size(
+    const n3d_target_t* framebuffer,
+    const uint32_t num_threads,
+    uint32_t& bin_w,
+    uint32_t& bin_h);
+
+// divide a target into bins.  bins along the right and bottom edges are
+// cropped to fit when the target is not a multiple of the bin size.
 bool n3d_frame_create(
     n3d_framebuffer_t* frame,
-    const n3d_target_t* framebuffer);
+    const n3d_target_t* framebuffer,
+    const uint32_t bin_w,
+    const uint32_t bin_h);
 
 void n3d_frame_free(
     n3d_framebuffer_t* frame);
@@ -33,6 +174,29 @@ void n3d_frame_send_triangle(
     n3d_framebuffer_t* frame,
     n3d_rasterizer_t::triangle_t& triangle);
 
+// take an empty batch from the frame pool.  this may be called from any
+// thread between presents.
+n3d_batch_t* n3d_frame_batch_new(
+    n3d_framebuffer_t* frame);
+
+// add a triangle to a batch and find the bins it overlaps.
+// this may be called from any thread as long as each uses its own batch.
+void n3d_frame_batch_triangle(
+    const n3d_framebuffer_t* frame,
+    n3d_batch_t* batch,
+    const n3d_rasterizer_t::triangle_t& triangle);
+
+// send all of the triangles in a batch to their bins
+void n3d_frame_send_batch(
+    n3d_framebuffer_t* frame,
+    const n3d_batch_t* batch);
+
+// move on to the next frame after a present.  the batches and triangles of
+// the frame before the one just presented are reused, so the bins must have
+// finished with it.
+void n3d_frame_next(
+    n3d_framebuffer_t* frame);
+
 void n3d_frame_send_texture(
     n3d_framebuffer_t* frame,
     const n3d_texture_t* texture);
@@ -52,3 +216,19 @@ void n3d_frame_clear(
 
 void n3d_frame_present(
     n3d_framebuffer_t* frame);
+
+// draw into a new render target which is the same size as the last
+void n3d_frame_send_target(
+    n3d_framebuffer_t* frame,
+    const n3d_target_t* target);
+
+// split cells which took a large share of the last frames triangles and merge
+// those which have cooled down.  this must only be called between frames and
+// returns true if the set of active bins changed.
+bool n3d_frame_rebalance(
+    n3d_framebuffer_t* frame,
+    const uint32_t num_threads);
+
+// memory in bytes held by commands queued to the bins
+size_t n3d_frame_command_bytes(
+    const n3d_framebuffer_t* frame);
@@ -1,7 +1,10 @@
 // n3d_nano3dcpp
 //   implement the nano3d api
 
+#include <algorithm>
 #include <array>
+#include <memory>
+#include <vector>
 
 #include "../nano3d.h"
 #include "n3d_bin.h"
@@ -11,61 +14,407 @@
 #include "n3d_schedule.h"
 #include "n3d_triangle.h"
 #include "n3d_util.h"
+#include "n3d_vertex_array.h"
 
 namespace {
 
-static const size_t c_buffer_size = 1024;
+// post transform vertex cache
+//   maps vertex buffer indices onto slots in the staging area so that each
+//   unique vertex referenced by a draw is fetched and transformed only once.
+struct vertex_cache_t {
 
-struct vertex_array_t {
+    vertex_cache_t()
+        : epoch_(0)
+    {
+    }
 
-    // matrix transformation
-    void transform(const uint32_t count, const mat4f_t& m)
+    // start a new draw from a vertex buffer holding num_verts vertices
+    void begin(const uint32_t num_verts)
     {
-        for (uint32_t i = 0; i < count; ++i) {
-            // load data
-            float &x = x_[i], &y = y_[i], &z = z_[i], &w = w_[i];
-            // transform vertices
-            const float tx = x * m(0, 0) + y * m(1, 0) + z * m(2, 0) + w * m(3, 0);
-            const float ty = x * m(0, 1) + y * m(1, 1) + z * m(2, 1) + w * m(3, 1);
-            const float tz = x * m(0, 2) + y * m(1, 2) + z * m(2, 2) + w * m(3, 2);
-            const float tw = x * m(0, 3) + y * m(1, 3) + z * m(2, 3) + w * m(3, 3);
-            // save data
-            (x = tx), (y = ty), (z = tz), (w = tw);
+        if (tag_.size() < num_verts) {
+            tag_.resize(num_verts);
+        }
+        // tags are only valid for the current epoch, so bumping it will
+        // invalidate the whole cache without touching every entry.
+        if (++epoch_ == 0) {
+            for (tag_t& tag : tag_) {
+                tag.epoch_ = 0;
+            }
+            epoch_ = 1;
         }
+        index_.clear();
     }
 
-    // perspecive division
-    void w_divide(const uint32_t count)
+    // return the staging slot for a vertex, allocating one on a miss
+    uint32_t insert(const uint32_t index)
     {
-        for (uint32_t i = 0; i < count; ++i) {
-            x_[i] /= w_[i];
-            y_[i] /= w_[i];
-            z_[i] /= w_[i];
+        n3d_assert(index < tag_.size());
+        tag_t& tag = tag_[index];
+        if (tag.epoch_ != epoch_) {
+            tag.epoch_ = epoch_;
+            tag.slot_ = uint32_t(index_.size());
+            index_.push_back(index);
         }
+        return tag.slot_;
+    }
+
+    // number of unique vertices referenced so far
+    uint32_t size() const
+    {
+        return uint32_t(index_.size());
+    }
+
+    struct tag_t {
+        uint32_t epoch_;
+        uint32_t slot_;
+    };
+
+    // per vertex buffer entry cache tag
+    std::vector<tag_t> tag_;
+    // vertex buffer index for each staging slot
+    std::vector<uint32_t> index_;
+    // staging slot for each index in the draw
+    std::vector<uint32_t> local_;
+    uint32_t epoch_;
+};
+
+// number of triangles in each chunk of a draw call.  chunks are processed in
+// parallel by the front end.
+static const uint32_t c_chunk_size = 1024;
+
+// number of instances in each item of the instance culling job
+static const uint32_t c_instance_block = 256;
+
+// default memory budget for queued bin commands
+static const uint32_t c_command_budget = 8 * 1024 * 1024;
+
+// smallest bin size which may be requested, in pixels along each side.
+// smaller bins cost more to bin into than they save.
+static const uint32_t c_bin_size_min = 16;
+
+// per thread front end state
+struct front_end_t {
+
+    front_end_t()
+        : stats_()
+    {
     }
 
-    // transform into normalized device coordinates
-    void ndc_transform(const uint32_t count, const vec2f_t& sf)
+    // untransformed vertex positions fetched from the vertex buffer, which
+    // are shared by every instance of a draw call.
+    n3d_vertex_array_t source_;
+
+    // vertex array is used as a staging area for vertices traveling through
+    // the pipeline towards the rasterizers.
+    n3d_vertex_array_t stage_;
+
+    // maps indices onto unique vertices in the staging area
+    vertex_cache_t cache_;
+
+    // staging slots for the triangles which survived clipping
+    std::vector<uint32_t> clipped_;
+
+    // triangles which have been set up
+    std::vector<n3d_rasterizer_t::triangle_t> triangle_;
+
+    // statistics gathered since the last present
+    n3d_stats_t stats_;
+};
+
+// a draw call being processed by the front end
+struct draw_call_t {
+
+    draw_call_t()
+        : buffer_(nullptr)
+        , frame_(nullptr)
+        , indices_(nullptr)
+        , num_tris_(0)
+        , mode_(n3d_prim_tri)
+        , prep_flags_(0)
+        , num_chunks_(0)
+        , instances_(nullptr)
+        , num_instances_(0)
+        , group_size_(0)
     {
+    }
+
+    // the vertex buffer being drawn
+    const n3d_vertex_buffer_t* buffer_;
+    // the frame whose bins the triangles are binned for
+    const n3d_framebuffer_t* frame_;
+    // half the render target size
+    vec2f_t screen_;
+    // composite matrix of the bound model view and projection
+    mat4f_t comp_mat_;
+
+    const uint32_t* indices_;
+    uint32_t num_tris_;
+    n3d_primitive_e mode_;
+    int prep_flags_;
+    uint32_t num_chunks_;
+    // per instance model matrices, or nullptr for a single instance
+    const mat4f_t* instances_;
+    // composite matrix and visibility of each instance.  after culling
+    // comp_ holds only the visible instances in their original order.
+    std::vector<mat4f_t> comp_;
+    std::vector<uint8_t> visible_;
+    uint32_t num_instances_;
+    // number of instances processed by each job item
+    uint32_t group_size_;
+    // output batch for each job item
+    std::vector<n3d_batch_t*> batch_;
+};
+
+// a command recorded by a stream, which is sent to the bins at present
+struct recorded_t {
+
+    enum {
+        rec_batch,
+        rec_rasterizer,
+        rec_texture,
+    } type_;
+
+    union {
+        const n3d_batch_t* batch_;
+        const n3d_rasterizer_t* rasterizer_;
+        const n3d_texture_t* texture_;
+    };
+};
+
+// accumulate front end statistics
+void stats_add(
+    n3d_stats_t& out,
+    const n3d_stats_t& in)
+{
+    out.triangles_ += in.triangles_;
+    out.culled_bounds_ += in.culled_bounds_;
+    out.culled_frustum_ += in.culled_frustum_;
+    out.culled_backface_ += in.culled_backface_;
+    out.culled_coverage_ += in.culled_coverage_;
+    out.setup_ += in.setup_;
+}
+
+// find the composite matrix and visibility of a block of instances
+void draw_cull(
+    draw_call_t& draw,
+    uint32_t item)
+{
+    const n3d_bounds_t* bounds = draw.buffer_->bounds_;
+    const uint32_t first = item * c_instance_block;
+    const uint32_t last = min2(first + c_instance_block, draw.num_instances_);
+    for (uint32_t i = first; i < last; ++i) {
+        // composite matrix combines instance, modelview and projection
+        mat4f_t& m = draw.comp_[i];
+        m = draw.instances_[i];
+        n3d_multiply(m, draw.comp_mat_);
+        draw.visible_[i] = (!bounds || n3d_bounds_visible(*bounds, m)) ? 1 : 0;
+    }
+}
+
+// set up a draw call and find the number of job items needed to process it,
+// which is zero when everything was culled.  cull is passed the number of
+// blocks of instances which must be run through draw_cull.
+template <typename cull_t>
+bool draw_begin(
+    draw_call_t& draw,
+    n3d_stats_t& stats,
+    uint32_t num_indices,
+    const uint32_t* indices,
+    n3d_primitive_e mode,
+    uint32_t num_instances,
+    const mat4f_t* instances,
+    uint32_t& num_items,
+    cull_t cull)
+{
+    num_items = 0;
+    const n3d_vertex_buffer_t& vb = *draw.buffer_;
+
+    int prep_flags = e_prepare_depth;
+    prep_flags |= (vb.uv_ ? e_prepare_uv : 0);
+    prep_flags |= (vb.rgb_ ? e_prepare_rgb : 0);
+
+    // find the number of triangles in the index stream
+    uint32_t num_tris = 0;
+    switch (mode) {
+    case n3d_prim_tri:
+        num_tris = num_indices / 3;
+        break;
+    case n3d_prim_tri_strip:
+    case n3d_prim_tri_fan:
+        num_tris = (num_indices >= 3) ? num_indices - 2 : 0;
+        break;
+    default:
+        return false;
+    }
+
+    // find the composite matrix of each instance and cull any instances
+    // whose bounds are outside of the view frustum.
+    draw.instances_ = instances;
+    if (instances) {
+        draw.comp_.resize(num_instances);
+        draw.visible_.resize(num_instances);
+        draw.num_instances_ = num_instances;
+        cull((num_instances + c_instance_block - 1) / c_instance_block);
+        // pack the visible instances, keeping their order
+        num_instances = 0;
+        for (uint32_t i = 0; i < draw.num_instances_; ++i) {
+            if (draw.visible_[i]) {
+                draw.comp_[num_instances++] = draw.comp_[i];
+            }
+        }
+    } else {
+        const n3d_bounds_t* bounds = vb.bounds_;
+        num_instances = (!bounds || n3d_bounds_visible(*bounds, draw.comp_mat_)) ? 1 : 0;
+        draw.comp_.assign(1, draw.comp_mat_);
+    }
+
+    stats.culled_bounds_ += (instances ? draw.num_instances_ : 1) - num_instances;
+    stats.triangles_ += num_tris * num_instances;
+    if (!num_instances)
+        return true;
+
+    // split the index stream into chunks of whole triangles
+    const uint32_t num_chunks = (num_tris + c_chunk_size - 1) / c_chunk_size;
+
+    // small meshes group many instances into each job item so the vertex
+    // fetch is shared between them.  a mesh spanning several chunks takes
+    // one instance per item so the batches stay in submission order.
+    uint32_t group_size = 1;
+    if (num_chunks == 1) {
+        group_size = max2(1u, c_chunk_size / num_tris);
+    }
+    const uint32_t num_groups = (num_instances + group_size - 1) / group_size;
+    num_items = num_groups * num_chunks;
+
+    draw.indices_ = indices;
+    draw.num_tris_ = num_tris;
+    draw.mode_ = mode;
+    draw.prep_flags_ = prep_flags;
+    draw.num_chunks_ = num_chunks;
+    draw.num_instances_ = num_instances;
+    draw.group_size_ = group_size;
+    return true;
+}
+
+// transform, set up and bin one chunk of a draw call for a group of
+// instances
+void draw_chunk(
+    draw_call_t& draw,
+    front_end_t& front,
+    uint32_t item)
+{
+    n3d_vertex_array_t& stage = front.stage_;
+    vertex_cache_t& cache = front.cache_;
+    const n3d_vertex_buffer_t& vb = *draw.buffer_;
+    n3d_vertex_array_t& source = front.source_;
+    const int prep_flags = draw.prep_flags_;
+    n3d_batch_t* batch = draw.batch_[item];
+
+    // find the chunk and range of instances for this item
+    const uint32_t chunk = item % draw.num_chunks_;
+    const uint32_t inst_first = (item / draw.num_chunks_) * draw.group_size_;
+    const uint32_t inst_last = min2(inst_first + draw.group_size_, draw.num_instances_);
+
+    // find the range of triangles in this chunk
+    const uint32_t first = chunk * c_chunk_size;
+    const uint32_t num_tris = min2(draw.num_tris_ - first, c_chunk_size);
+    const uint32_t* indices = draw.indices_;
+
+    // map each triangle vertex onto a unique slot in the staging area.  for
+    // strips and fans the shared vertices will hit in the cache so they are
+    // only fetched and transformed once.
+    cache.begin(vb.num_);
+    cache.local_.resize(num_tris * 3);
+    uint32_t* local = cache.local_.data();
+    switch (draw.mode_) {
+    case n3d_prim_tri:
+        for (uint32_t i = 0; i < num_tris * 3; ++i) {
+            local[i] = cache.insert(indices[first * 3 + i]);
+        }
+        break;
+    case n3d_prim_tri_strip:
+        for (uint32_t i = 0; i < num_tris; ++i) {
+            const uint32_t t = first + i;
+            // odd triangles swap their first two vertices to keep the winding
+            const uint32_t odd = t & 1;
+            local[i * 3 + 0] = cache.insert(indices[t + odd]);
+            local[i * 3 + 1] = cache.insert(indices[t + (odd ^ 1)]);
+            local[i * 3 + 2] = cache.insert(indices[t + 2]);
+        }
+        break;
+    case n3d_prim_tri_fan: {
+        const uint32_t hub = cache.insert(indices[0]);
+        for (uint32_t i = 0; i < num_tris; ++i) {
+            const uint32_t t = first + i;
+            local[i * 3 + 0] = hub;
+            local[i * 3 + 1] = cache.insert(indices[t + 1]);
+            local[i * 3 + 2] = cache.insert(indices[t + 2]);
+        }
+    } break;
+    default:
+        n3d_assert(!"unknown primitive mode");
+    }
+
+    const uint32_t count = cache.size();
+    const uint32_t* index = cache.index_.data();
+    source.resize(count);
+    stage.resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        // shove vertices into the source array
+        const vec3f_t& v = vb.pos_[index[i]];
+        source.x_[i] = v.x;
+        source.y_[i] = v.y;
+        source.z_[i] = v.z;
+        source.w_[i] = 1.f;
+    }
+    // upload uv coordinates
+    if (prep_flags & e_prepare_uv) {
         for (uint32_t i = 0; i < count; ++i) {
-            x_[i] = (x_[i] + 1.f) * sf.x;
-            y_[i] = (y_[i] + 1.f) * sf.y;
+            const vec2f_t& v = vb.uv_[index[i]];
+            stage.u_[i] = v.x;
+            stage.v_[i] = v.y;
+        }
+    }
+    // upload rgb values
+    if (prep_flags & e_prepare_rgb) {
+        for (uint32_t i = 0; i < count; ++i) {
+            const vec3f_t& v = vb.rgb_[index[i]];
+            stage.r_[i] = v.x;
+            stage.g_[i] = v.y;
+            stage.b_[i] = v.z;
         }
     }
 
-    // pos
-    std::array<float, c_buffer_size> x_;
-    std::array<float, c_buffer_size> y_;
-    std::array<float, c_buffer_size> z_;
-    std::array<float, c_buffer_size> w_;
-    // tex coords
-    std::array<float, c_buffer_size> u_;
-    std::array<float, c_buffer_size> v_;
-    // colour
-    std::array<float, c_buffer_size> r_;
-    std::array<float, c_buffer_size> g_;
-    std::array<float, c_buffer_size> b_;
-};
+    const vec2f_t screen = draw.screen_;
+
+    for (uint32_t inst = inst_first; inst < inst_last; ++inst) {
+
+        // clipping only appends to the staging area so the attributes
+        // uploaded above are still intact for each instance.
+        stage.transform(count, draw.comp_[inst], source);
+
+        // cull and clip triangles in clip space, which may add more vertices
+        uint32_t num_verts = count;
+        const uint32_t num_clipped = n3d_clip_batch(
+            stage, num_verts, local, num_tris, front.clipped_, prep_flags, front.stats_);
+
+        // perspective division
+        stage.w_divide(num_verts);
+        stage.ndc_transform(num_verts, screen);
+
+        // set up triangles straight from the staging area
+        front.triangle_.resize(num_clipped);
+        const uint32_t num_out = n3d_prepare_batch(
+            front.triangle_.data(), stage, front.clipped_.data(), num_clipped, prep_flags,
+            front.stats_);
+        front.stats_.setup_ += num_out;
+
+        // bin the triangles ready for sending
+        for (uint32_t i = 0; i < num_out; ++i) {
+            n3d_frame_batch_triangle(draw.frame_, batch, front.triangle_[i]);
+        }
+    }
+}
 
 } // namespace {}
 
@@ -74,6 +423,12 @@ struct nano3d_t::detail_t {
     detail_t()
         : vertex_buffer_()
         , target_()
+        , stats_()
+        , command_budget_(c_command_budget)
+        , pipeline_(false)
+        , submit_stats_()
+        , unsubmitted_(0)
+        , presenting_(0)
     {
         n3d_identity(matrix_[n3d_model_view]);
         n3d_identity(matrix_[n3d_projection]);
@@ -86,9 +441,45 @@ struct nano3d_t::detail_t {
 
     void update_comp_mat();
 
+    // help the workers drain the bins while the queued commands are over
+    // the memory budget
+    void flush_commands();
+
+    // help the workers until all bins have presented a frame
+    void wait_frame(uint32_t frame);
+
+    // take the draws recorded by a stream.  this may be called from any
+    // thread.
+    void submit(
+        uint64_t key,
+        std::vector<recorded_t>& recorded,
+        n3d_stats_t& stats);
+
+    // send the draws submitted by streams to the bins in key order
+    void send_submitted();
+
+    // split bins and move them between workers to suit the last frame.
+    // this only happens when no frame is in flight and nothing has been
+    // sent for the next, as the bins must be idle.
+    void balance();
+
     n3d_result_e draw(
         uint32_t num_indices,
-        const uint32_t* indices);
+        const uint32_t* indices,
+        n3d_primitive_e mode,
+        uint32_t num_instances,
+        const mat4f_t* instances);
+
+    // job functions for a block of instances and a chunk of the current draw
+    static void cull_instances_thunk(
+        void* self,
+        uint32_t item,
+        uint32_t slot);
+
+    static void draw_chunk_thunk(
+        void* self,
+        uint32_t item,
+        uint32_t slot);
 
     // the bound vertex buffer
     n3d_vertex_buffer_t vertex_buffer_;
@@ -105,9 +496,35 @@ struct nano3d_t::detail_t {
     n3d_framebuffer_t frame_;
     n3d_schedule_t schedule_;
 
-    // vertex array is used as a staging area for vertices traveling through
-    // the pipeline towards the rasterizers.
-    vertex_array_t stage_;
+    // front end state for the host thread and each worker thread
+    std::vector<std::unique_ptr<front_end_t>> front_;
+
+    // statistics for the last presented frame
+    n3d_stats_t stats_;
+
+    // memory in bytes which queued bin commands may use
+    size_t command_budget_;
+
+    // set when present returns before the frame is complete
+    bool pipeline_;
+
+    // draws submitted by streams for this frame
+    struct submission_t {
+        uint64_t key_;
+        std::vector<recorded_t> recorded_;
+    };
+    n3d_spinlock_t submit_lock_;
+    std::vector<submission_t> submitted_;
+    // front end statistics of the submitted draws
+    n3d_stats_t submit_stats_;
+    // number of streams holding draws they have not submitted yet
+    n3d_atomic_t unsubmitted_;
+    // set while present() or wait() may move on or rebalance the frame,
+    // which streams must not overlap
+    n3d_atomic_t presenting_;
+
+    // the draw call being processed by the front end
+    draw_call_t draw_;
 
     struct {
         valid_t<n3d_rasterizer_t> rasterizer_;
@@ -138,107 +555,213 @@ void nano3d_t::detail_t::update_comp_mat()
     comp_mat_dirty_ = false;
 }
 
+void nano3d_t::detail_t::wait_frame(uint32_t frame)
+{
+    n3d_bin_t* bin = nullptr;
+    while (!schedule_.frame_is_done(frame)) {
+
+        // if we are waiting then we can pitch in too
+        if ((bin = schedule_.get_work(0))) {
+            n3d_bin_process(bin);
+        } else {
+            n3d_yield();
+        }
+    }
+}
+
+void nano3d_t::detail_t::balance()
+{
+    const uint32_t submitted = schedule_.submitted();
+    if (submitted == 0 || frame_.sent_ != 0)
+        return;
+    if (!schedule_.frame_is_done(submitted - 1))
+        return;
+
+    // split up any bins which held back the workers
+    n3d_frame_rebalance(&frame_, schedule_.num_threads());
+
+    // even out the time each worker spends on its bins
+    schedule_.balance();
+}
+
 n3d_result_e nano3d_t::detail_t::draw(
     uint32_t num_indices,
-    const uint32_t* indices)
+    const uint32_t* indices,
+    n3d_primitive_e mode,
+    uint32_t num_instances,
+    const mat4f_t* instances)
 {
-    n3d_vertex_buffer_t& vb = vertex_buffer_;
-
     // update the composite pipeline matrix
     update_comp_mat();
 
-    // XXX: what does state_.buffer_ do again?
-    int prep_flags = e_prepare_depth;
-    prep_flags |= ((state_.buffer_ && state_.buffer_.get()->uv_) ? e_prepare_uv : 0);
-    prep_flags |= ((state_.buffer_ && state_.buffer_.get()->rgb_) ? e_prepare_rgb : 0);
-
-    const uint32_t *end = indices + num_indices;
-    while (indices < end) {
-
-        // todo: round to a multiple of three
-        const uint32_t written = min2<uint32_t>(num_indices, (c_buffer_size / 3) * 3);
-
-        for (uint32_t i = 0; i < written; ++i) {
-            // shove vertices into staging array
-            const vec3f_t& v = vb.pos_[indices[i]];
-            stage_.x_[i] = v.x;
-            stage_.y_[i] = v.y;
-            stage_.z_[i] = v.z;
-            stage_.w_[i] = 1.f;
-        }
-        // upload uv coordinates
-        if (prep_flags & e_prepare_uv) {
-            for (uint32_t i = 0; i < written; ++i) {
-                const vec2f_t& v = vb.uv_[indices[i]];
-                stage_.u_[i] = v.x;
-                stage_.v_[i] = v.y;
-            }
-        }
-        // upload uv coordinates
-        if (prep_flags & e_prepare_rgb) {
-            for (uint32_t i = 0; i < written; ++i) {
-                const vec3f_t& v = vb.rgb_[indices[i]];
-                stage_.r_[i] = v.x;
-                stage_.g_[i] = v.y;
-                stage_.b_[i] = v.z;
-            }
+    draw_.buffer_ = &vertex_buffer_;
+    draw_.frame_ = &frame_;
+    draw_.screen_ = { float(target_.width_ / 2), float(target_.height_ / 2) };
+    draw_.comp_mat_ = comp_mat_;
+
+    // the host owns the first front end while no job is running
+    uint32_t num_items = 0;
+    const bool valid = draw_begin(
+        draw_, front_[0]->stats_, num_indices, indices, mode, num_instances, instances,
+        num_items, [this](uint32_t num_blocks) {
+            const n3d_job_t job = { cull_instances_thunk, this, num_blocks };
+            schedule_.run(job);
+        });
+    if (!valid)
+        return n3d_fail;
+    if (!num_items)
+        return n3d_result_e::n3d_sucess;
+
+    draw_.batch_.resize(num_items);
+    for (n3d_batch_t*& batch : draw_.batch_) {
+        batch = n3d_frame_batch_new(&frame_);
+    }
+
+    // transform, set up and bin all chunks in parallel
+    const n3d_job_t job = { draw_chunk_thunk, this, num_items };
+    schedule_.run(job);
+
+    // send the batches to the bins in submission order
+    for (const n3d_batch_t* batch : draw_.batch_) {
+        n3d_frame_send_batch(&frame_, batch);
+        flush_commands();
+    }
+
+    return n3d_result_e::n3d_sucess;
+}
+
+void nano3d_t::detail_t::flush_commands()
+{
+    // note: this also keeps us from stalling when there are no workers
+    while (n3d_frame_command_bytes(&frame_) > command_budget_) {
+        n3d_bin_t* bin = schedule_.get_work(0);
+        if (bin) {
+            n3d_bin_process(bin);
+        } else {
+            n3d_yield();
         }
+    }
+}
 
-        // composite matrix combines modelview, projection and ndc transform
-        stage_.transform(written, comp_mat_);
+void nano3d_t::detail_t::submit(
+    uint64_t key,
+    std::vector<recorded_t>& recorded,
+    n3d_stats_t& stats)
+{
+    n3d_assert(!n3d_atomic_load(presenting_));
+    if (!recorded.empty()) {
+        n3d_atomic_dec(unsubmitted_);
+    }
+    n3d_scope_spinlock_t guard(submit_lock_);
+    submitted_.emplace_back();
+    submission_t& sub = submitted_.back();
+    sub.key_ = key;
+    sub.recorded_.swap(recorded);
+    recorded.clear();
+    stats_add(submit_stats_, stats);
+    stats = n3d_stats_t();
+}
 
-        // some kind of clipping must happen here
+void nano3d_t::detail_t::send_submitted()
+{
+    std::vector<submission_t> submitted;
+    {
+        n3d_scope_spinlock_t guard(submit_lock_);
+        submitted.swap(submitted_);
+    }
 
-        // perspective division
-        stage_.w_divide(written);
-
-        const vec2f_t screen = { target_.width_ / 2, target_.height_ / 2 };
-        stage_.ndc_transform(written, screen);
-
-        // XXX: for now just convert back into AoS form :(
-        //      replace me when n3d_prepare() is converted to SoA form
-        for (uint32_t i = 2; i < written; i += 3) {
-            std::array<n3d_vertex_t, 3> v;
-            for (uint32_t k = 0; k < 3; ++k) {
-              v[k].p_.x = stage_.x_[(i - 2) + k];
-              v[k].p_.y = stage_.y_[(i - 2) + k];
-              v[k].p_.z = stage_.z_[(i - 2) + k];
-              v[k].p_.w = stage_.w_[(i - 2) + k];
+    // the key decides the order, not which thread submitted first
+    std::stable_sort(submitted.begin(), submitted.end(),
+        [](const submission_t& a, const submission_t& b) {
+            return a.key_ < b.key_;
+        });
+
+    for (const submission_t& sub : submitted) {
+        for (const recorded_t& rec : sub.recorded_) {
+            switch (rec.type_) {
+            case recorded_t::rec_batch:
+                n3d_frame_send_batch(&frame_, rec.batch_);
+                flush_commands();
+                break;
+            case recorded_t::rec_rasterizer:
+                n3d_frame_send_rasterizer(&frame_, rec.rasterizer_);
+                break;
+            case recorded_t::rec_texture:
+                n3d_frame_send_texture(&frame_, rec.texture_);
+                break;
             }
-            n3d_rasterizer_t::triangle_t tri;
-            if (!n3d_prepare(tri, v[0], v[1], v[2], prep_flags))
-                continue;
-            // send this triangle off for upload to the bins
-            n3d_frame_send_triangle(&frame_, tri);
         }
-
-        // advance along the index stream
-        indices += written;
-        num_indices -= written;
     }
+}
 
-    return n3d_result_e::n3d_sucess;
+void nano3d_t::detail_t::cull_instances_thunk(
+    void* self,
+    uint32_t item,
+    uint32_t slot)
+{
+    detail_t* d = static_cast<nano3d_t::detail_t*>(self);
+    draw_cull(d->draw_, item);
+}
+
+void nano3d_t::detail_t::draw_chunk_thunk(
+    void* self,
+    uint32_t item,
+    uint32_t slot)
+{
+    detail_t* d = static_cast<nano3d_t::detail_t*>(self);
+    n3d_assert(slot < d->front_.size());
+    draw_chunk(d->draw_, *d->front_[slot], item);
 }
 
 n3d_result_e nano3d_t::start(
     const n3d_target_t* f,
     const uint32_t num_planes,
-    const uint32_t num_threads)
+    const uint32_t num_threads,
+    const n3d_settings_t* settings)
 {
     nano3d_t::detail_t& d_ = *checked(detail_);
     d_.target_ = *f;
 
+    // use the requested bin size or pick one to suit the threads
+    uint32_t bin_w = 0, bin_h = 0;
+    n3d_frame_bin_size(f, num_threads, bin_w, bin_h);
+    if (settings && settings->bin_width_) {
+        bin_w = settings->bin_width_;
+    }
+    if (settings && settings->bin_height_) {
+        bin_h = settings->bin_height_;
+    }
+    if (bin_w < c_bin_size_min || bin_h < c_bin_size_min) {
+        return n3d_fail;
+    }
+
     // create a frame buffer and all associated bins
-    if (!n3d_frame_create(&d_.frame_, f))
+    if (!n3d_frame_create(&d_.frame_, f, bin_w, bin_h))
         return n3d_fail;
 
+    // every bin always holds one chunk, so allow a couple each at least
+    // otherwise we could never get back under budget
+    const uint32_t budget = (settings && settings->command_budget_) ?
+        settings->command_budget_ : c_command_budget;
+    const size_t min_budget =
+        d_.frame_.bin_.size() * 2 * n3d_command_pool_t::chunk_bytes();
+    d_.command_budget_ = max2(size_t(budget), min_budget);
+
+    // create front end state for this thread and each worker
+    d_.front_.clear();
+    for (uint32_t i = 0; i < num_threads + 1; ++i) {
+        d_.front_.emplace_back(new front_end_t);
+    }
+
     // add the bins to the bin manager
     for (std::unique_ptr<n3d_bin_t>& bin : d_.frame_.bin_) {
         d_.schedule_.add(bin.get(), 1);
     }
 
     // start the worker threads
-    if (!d_.schedule_.start(num_threads)) {
+    d_.pipeline_ = settings && settings->pipeline_frames_;
+    const bool pin = settings && settings->pin_threads_;
+    if (!d_.schedule_.start(num_threads, pin)) {
         return n3d_fail;
     }
 
@@ -248,6 +771,11 @@ n3d_result_e nano3d_t::start(
 n3d_result_e nano3d_t::stop()
 {
     nano3d_t::detail_t& d_ = *checked(detail_);
+    // let any frame still in flight finish
+    const uint32_t submitted = d_.schedule_.submitted();
+    if (submitted) {
+        d_.wait_frame(submitted - 1);
+    }
     d_.schedule_.stop();
     return n3d_sucess;
 }
@@ -285,6 +813,20 @@ n3d_result_e nano3d_t::bind(
     return n3d_sucess;
 }
 
+n3d_result_e nano3d_t::bind(
+    const n3d_target_t* in)
+{
+    nano3d_t::detail_t& d_ = *checked(detail_);
+    if (!in || !in->pixels_)
+        return n3d_fail;
+    // the bins are laid out for the target given to start
+    if (in->width_ != d_.target_.width_ || in->height_ != d_.target_.height_)
+        return n3d_fail;
+    d_.target_ = *in;
+    n3d_frame_send_target(&d_.frame_, in);
+    return n3d_sucess;
+}
+
 n3d_result_e nano3d_t::bind(
     const mat4f_t* in,
     const n3d_matrix_e slot)
@@ -305,12 +847,17 @@ n3d_result_e nano3d_t::bind(
 
 n3d_result_e nano3d_t::draw(
     const uint32_t num_indices,
-    const uint32_t* indices)
+    const uint32_t* indices,
+    const n3d_primitive_e mode)
 {
     nano3d_t::detail_t& d_ = *checked(detail_);
 #if NEW_PIPELINE
-    return d_.draw(num_indices, indices);
+    return d_.draw(num_indices, indices, mode, 1, nullptr);
 #else // NEW_PIPELINE
+    // only triangle lists are supported by the old pipeline
+    if (mode != n3d_prim_tri)
+        return n3d_fail;
+
     n3d_vertex_buffer_t& vb = d_.vertex_buffer_;
 
     // update the composite pipeline matrix
@@ -392,6 +939,7 @@ n3d_result_e nano3d_t::draw(
                 continue;
             // send this triangle off for upload to the bins
             n3d_frame_send_triangle(&d_.frame_, tri);
+            d_.flush_commands();
         }
     }
 
@@ -399,29 +947,120 @@ n3d_result_e nano3d_t::draw(
 #endif // NEW_PIPELINE
 }
 
-n3d_result_e nano3d_t::present()
+n3d_result_e nano3d_t::draw_instanced(
+    const uint32_t num_indices,
+    const uint32_t* indices,
+    const uint32_t num_instances,
+    const mat4f_t* instances,
+    const n3d_primitive_e mode)
+{
+    nano3d_t::detail_t& d_ = *checked(detail_);
+    n3d_assert(instances || !num_instances);
+#if NEW_PIPELINE
+    if (!num_instances)
+        return n3d_sucess;
+    return d_.draw(num_indices, indices, mode, num_instances, instances);
+#else // NEW_PIPELINE
+    // instancing is not supported by the old pipeline
+    return n3d_fail;
+#endif // NEW_PIPELINE
+}
+
+n3d_result_e nano3d_t::present(
+    n3d_fence_t* fence)
 {
     nano3d_t::detail_t& d_ = *checked(detail_);
     n3d_framebuffer_t& frame = d_.frame_;
 
+    // stream batches belong to the frame data and cell layout they were
+    // recorded with, so all of them must be submitted by now
+    n3d_assert(n3d_atomic_load(d_.unsubmitted_) == 0);
+    n3d_atomic_xchg(d_.presenting_, 1);
+
+    // draws from streams follow the ones made directly
+    d_.send_submitted();
+
+    // gather the front end statistics for this frame
+    n3d_stats_t& stats = d_.stats_;
+    stats = d_.submit_stats_;
+    d_.submit_stats_ = n3d_stats_t();
+    for (std::unique_ptr<front_end_t>& front : d_.front_) {
+        stats_add(stats, front->stats_);
+        front->stats_ = n3d_stats_t();
+    }
+
     // send the present command
+    const uint32_t num = d_.schedule_.submit();
     n3d_frame_present(&frame);
+    if (fence) {
+        *fence = num;
+    }
 
-    // ask the bin manager for work to do
-    n3d_bin_t* bin = nullptr;
-    while (!d_.schedule_.frame_is_done()) {
-
-        // if we are waiting then we can pitch in too
-        if ((bin = d_.schedule_.get_work(nullptr))) {
-            n3d_bin_process(bin);
-        } else {
-            n3d_yield();
-        }
+    // the next frame reuses the triangles of the frame before this one, so
+    // when pipelined only that must be done
+    if (!d_.pipeline_) {
+        d_.wait_frame(num);
+    } else if (num > 0) {
+        d_.wait_frame(num - 1);
     }
 
     // move on to the next frame
-    d_.schedule_.next_frame();
+    n3d_frame_next(&frame);
+    d_.balance();
 
+    n3d_atomic_xchg(d_.presenting_, 0);
+    return n3d_sucess;
+}
+
+n3d_result_e nano3d_t::wait(
+    const n3d_fence_t fence)
+{
+    nano3d_t::detail_t& d_ = *checked(detail_);
+    if (fence >= d_.schedule_.submitted())
+        return n3d_fail;
+    n3d_atomic_xchg(d_.presenting_, 1);
+    d_.wait_frame(fence);
+
+    // the bins may have gone idle so catch up on balancing
+    d_.balance();
+    n3d_atomic_xchg(d_.presenting_, 0);
+    return n3d_sucess;
+}
+
+n3d_result_e nano3d_t::run_tasks(
+    n3d_task_func_t func,
+    void* user,
+    const uint32_t count,
+    n3d_task_set_t** tasks)
+{
+    nano3d_t::detail_t& d_ = *checked(detail_);
+    if (!func || !tasks)
+        return n3d_fail;
+    n3d_job_t job;
+    job.func_ = func;
+    job.user_ = user;
+    job.count_ = count;
+    *tasks = d_.schedule_.start_tasks(job);
+    return n3d_sucess;
+}
+
+n3d_result_e nano3d_t::join(
+    n3d_task_set_t* tasks)
+{
+    nano3d_t::detail_t& d_ = *checked(detail_);
+    if (!tasks)
+        return n3d_fail;
+    d_.schedule_.join_tasks(tasks);
+    return n3d_sucess;
+}
+
+n3d_result_e nano3d_t::stats(
+    n3d_stats_t* out)
+{
+    nano3d_t::detail_t& d_ = *checked(detail_);
+    if (!out)
+        return n3d_fail;
+    *out = d_.stats_;
     return n3d_sucess;
 }
 
@@ -454,3 +1093,196 @@ n3d_result_e nano3d_t::unproject(
     //todo: implement
     return n3d_result_e::n3d_fail;
 }
+
+struct n3d_stream_t::detail_t {
+
+    detail_t(nano3d_t& context)
+        : context_(context)
+        , unsubmitted_(nullptr)
+        , vertex_buffer_()
+        , comp_mat_dirty_(true)
+    {
+        n3d_identity(matrix_[n3d_model_view]);
+        n3d_identity(matrix_[n3d_projection]);
+    }
+
+    // transform, set up and bin a draw call on this thread
+    n3d_result_e draw(
+        n3d_framebuffer_t& frame,
+        const n3d_target_t& target,
+        uint32_t num_indices,
+        const uint32_t* indices,
+        n3d_primitive_e mode,
+        uint32_t num_instances,
+        const mat4f_t* instances);
+
+    void record(const recorded_t& rec)
+    {
+        n3d_assert(unsubmitted_);
+        if (recorded_.empty()) {
+            n3d_atomic_inc(*unsubmitted_);
+        }
+        recorded_.push_back(rec);
+    }
+
+    nano3d_t& context_;
+    // the context count of streams with unsubmitted draws
+    n3d_atomic_t* unsubmitted_;
+
+    // the bound vertex buffer
+    n3d_vertex_buffer_t vertex_buffer_;
+
+    // the pipeline matrix stack
+    std::array<mat4f_t, 2> matrix_;
+    bool comp_mat_dirty_;
+
+    front_end_t front_;
+    draw_call_t draw_;
+
+    // commands recorded since the last submit
+    std::vector<recorded_t> recorded_;
+};
+
+n3d_result_e n3d_stream_t::detail_t::draw(
+    n3d_framebuffer_t& frame,
+    const n3d_target_t& target,
+    uint32_t num_indices,
+    const uint32_t* indices,
+    n3d_primitive_e mode,
+    uint32_t num_instances,
+    const mat4f_t* instances)
+{
+#if NEW_PIPELINE
+    // update the composite pipeline matrix
+    if (comp_mat_dirty_) {
+        draw_.comp_mat_ = matrix_[n3d_model_view];
+        n3d_multiply(draw_.comp_mat_, matrix_[n3d_projection]);
+        comp_mat_dirty_ = false;
+    }
+
+    draw_.buffer_ = &vertex_buffer_;
+    draw_.frame_ = &frame;
+    draw_.screen_ = { float(target.width_ / 2), float(target.height_ / 2) };
+
+    // the whole front end runs on the recording thread
+    uint32_t num_items = 0;
+    const bool valid = draw_begin(
+        draw_, front_.stats_, num_indices, indices, mode, num_instances, instances,
+        num_items, [this](uint32_t num_blocks) {
+            for (uint32_t i = 0; i < num_blocks; ++i) {
+                draw_cull(draw_, i);
+            }
+        });
+    if (!valid)
+        return n3d_fail;
+
+    draw_.batch_.resize(num_items);
+    for (uint32_t i = 0; i < num_items; ++i) {
+        n3d_batch_t* batch = n3d_frame_batch_new(&frame);
+        draw_.batch_[i] = batch;
+        draw_chunk(draw_, front_, i);
+
+        recorded_t rec;
+        rec.type_ = recorded_t::rec_batch;
+        rec.batch_ = batch;
+        record(rec);
+    }
+    return n3d_sucess;
+#else // NEW_PIPELINE
+    // streams are not supported by the old pipeline
+    return n3d_fail;
+#endif // NEW_PIPELINE
+}
+
+n3d_stream_t::n3d_stream_t(
+    nano3d_t& context)
+    : detail_(new n3d_stream_t::detail_t(context))
+{
+    n3d_assert(detail_);
+    detail_->unsubmitted_ = &checked(context.detail_)->unsubmitted_;
+}
+
+n3d_stream_t::~n3d_stream_t()
+{
+    n3d_assert(detail_);
+    // recorded draws must be submitted before the stream goes away
+    n3d_assert(detail_->recorded_.empty());
+    delete detail_;
+}
+
+n3d_result_e n3d_stream_t::bind(
+    const n3d_vertex_buffer_t* in)
+{
+    detail_t& d_ = *checked(detail_);
+    d_.vertex_buffer_ = *in;
+    return n3d_sucess;
+}
+
+n3d_result_e n3d_stream_t::bind(
+    const n3d_rasterizer_t* in)
+{
+    detail_t& d_ = *checked(detail_);
+    recorded_t rec;
+    rec.type_ = recorded_t::rec_rasterizer;
+    rec.rasterizer_ = in;
+    d_.record(rec);
+    return n3d_sucess;
+}
+
+n3d_result_e n3d_stream_t::bind(
+    const n3d_texture_t* in)
+{
+    detail_t& d_ = *checked(detail_);
+    recorded_t rec;
+    rec.type_ = recorded_t::rec_texture;
+    rec.texture_ = in;
+    d_.record(rec);
+    return n3d_sucess;
+}
+
+n3d_result_e n3d_stream_t::bind(
+    const mat4f_t* in,
+    const n3d_matrix_e slot)
+{
+    detail_t& d_ = *checked(detail_);
+    d_.matrix_[slot] = *in;
+    d_.comp_mat_dirty_ = true;
+    return n3d_sucess;
+}
+
+n3d_result_e n3d_stream_t::draw(
+    const uint32_t num_indices,
+    const uint32_t* indices,
+    const n3d_primitive_e mode)
+{
+    detail_t& d_ = *checked(detail_);
+    nano3d_t::detail_t& context = *checked(d_.context_.detail_);
+    n3d_assert(!n3d_atomic_load(context.presenting_));
+    return d_.draw(context.frame_, context.target_, num_indices, indices, mode, 1, nullptr);
+}
+
+n3d_result_e n3d_stream_t::draw_instanced(
+    const uint32_t num_indices,
+    const uint32_t* indices,
+    const uint32_t num_instances,
+    const mat4f_t* instances,
+    const n3d_primitive_e mode)
+{
+    detail_t& d_ = *checked(detail_);
+    n3d_assert(instances || !num_instances);
+    if (!num_instances)
+        return n3d_sucess;
+    nano3d_t::detail_t& context = *checked(d_.context_.detail_);
+    n3d_assert(!n3d_atomic_load(context.presenting_));
+    return d_.draw(
+        context.frame_, context.target_, num_indices, indices, mode, num_instances, instances);
+}
+
+n3d_result_e n3d_stream_t::submit(
+    const uint64_t key)
+{
+    detail_t& d_ = *checked(detail_);
+    nano3d_t::detail_t& context = *checked(d_.context_.detail_);
+    context.submit(key, d_.recorded_, d_.front_.stats_);
+    return n3d_sucess;
+}
@@ -1,5 +1,8 @@
 #pragma once
 #include <array>
+#include <atomic>
+#include <memory>
+#include <vector>
 
 #include "n3d_atomic.h"
 #include "n3d_forward.h"
@@ -18,9 +21,12 @@
 
 #if (PIPE_TYPE == PIPE_TYPE_EXPERIMENTAL)
 //note: this pipe is suitable for only ONE producer and ONE consumer. there
-//      must not be concurrent access to either end of this pipe.  it is my
-//      hop that this pipe design will minimise the contention between
-//      producer and the consumer to a minium.
+//      must not be concurrent access to either end of this pipe.  each end
+//      owns one index and publishes it with a release store, which the other
+//      end reads with an acquire load, so items are always written before
+//      they can be read and read before their slot is reused.  the indices
+//      live on their own cache lines along with a copy of the other index,
+//      which is only refreshed when the pipe looks full or empty.
 template <typename type_t, uint32_t size_ = 1024>
 struct n3d_pipe_t {
 
@@ -29,10 +35,10 @@ struct n3d_pipe_t {
 
     n3d_pipe_t()
         : head_(0)
+        , tail_cache_(0)
         , tail_(0)
+        , head_cache_(0)
     {
-        // set all locks to unlocked
-        lock_.fill(c_unlocked);
     }
 
     n3d_pipe_t(const n3d_pipe_t&) = delete;
@@ -40,39 +46,65 @@ struct n3d_pipe_t {
     // called by the producer thread
     bool push(const type_t& in)
     {
-        const uint32_t i = head_ & mask_;
-        uint8_t& lock = lock_[i];
-        if (lock == c_unlocked) {
-            data_[i] = in;
-            lock = c_locked;
-            ++head_;
-            return true;
-        }
-        return false;
+        return push_n(&in, 1) == 1;
     }
 
     // called by the consumer thread
     bool pop(type_t& out)
     {
-        const uint32_t i = tail_ & mask_;
-        uint8_t& lock = lock_[i];
-        if (lock == c_locked) {
-            out = data_[i];
-            lock = c_unlocked;
-            ++tail_;
-            return true;
+        return pop_n(&out, 1) == 1;
+    }
+
+    // called by the producer thread.  push as many of num items as will fit
+    // and return the number pushed, which are published all at once.
+    uint32_t push_n(const type_t* in, uint32_t num)
+    {
+        const uint32_t head = head_.load(std::memory_order_relaxed);
+        uint32_t space = size_ - (head - tail_cache_);
+        if (space < num) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            space = size_ - (head - tail_cache_);
         }
-        return false;
+        num = min2(num, space);
+        for (uint32_t i = 0; i < num; ++i) {
+            data_[(head + i) & mask_] = in[i];
+        }
+        head_.store(head + num, std::memory_order_release);
+        return num;
+    }
+
+    // called by the consumer thread.  pop up to num items and return the
+    // number popped, whose slots are freed all at once.
+    uint32_t pop_n(type_t* out, uint32_t num)
+    {
+        const uint32_t tail = tail_.load(std::memory_order_relaxed);
+        uint32_t avail = head_cache_ - tail;
+        if (avail < num) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            avail = head_cache_ - tail;
+        }
+        num = min2(num, avail);
+        for (uint32_t i = 0; i < num; ++i) {
+            out[i] = data_[(tail + i) & mask_];
+        }
+        tail_.store(tail + num, std::memory_order_release);
+        return num;
     }
 
 protected:
-    static const uint8_t c_unlocked = 0;
-    static const uint8_t c_locked = 1;
     static const uint32_t mask_ = size_ - 1;
 
+    // written by the producer
+    std::atomic<uint32_t> head_;
+    uint32_t tail_cache_;
+    uint8_t pad0_[c_cache_line];
+
+    // written by the consumer
+    std::atomic<uint32_t> tail_;
+    uint32_t head_cache_;
+    uint8_t pad1_[c_cache_line];
+
     std::array<type_t, size_> data_;
-    std::array<uint8_t, size_> lock_;
-    uint32_t head_, tail_;
 };
 #endif
 
@@ -130,6 +162,24 @@ struct n3d_pipe_t {
         return false;
     }
 
+    uint32_t push_n(const type_t* in, uint32_t num)
+    {
+        uint32_t i = 0;
+        while (i < num && push(in[i])) {
+            ++i;
+        }
+        return i;
+    }
+
+    uint32_t pop_n(type_t* out, uint32_t num)
+    {
+        uint32_t i = 0;
+        while (i < num && pop(out[i])) {
+            ++i;
+        }
+        return i;
+    }
+
 protected:
     static const uint8_t c_unlocked = 0;
     static const uint8_t c_locked = 1;
@@ -142,3 +192,195 @@ protected:
     n3d_atomic_t head_, tail_;
 };
 #endif
+
+// a fixed size block of items forming part of a n3d_chunk_pipe_t
+template <typename type_t, uint32_t size_>
+struct n3d_chunk_t {
+
+    n3d_chunk_t()
+        : count_(0)
+        , next_(nullptr)
+    {
+    }
+
+    std::array<type_t, size_> data_;
+    // number of items written by the producer
+    std::atomic<uint32_t> count_;
+    // the chunk which follows this one, set by the producer once it is full
+    std::atomic<n3d_chunk_t*> next_;
+};
+
+// a pool of chunks shared between many chunk pipes.  any thread may take a
+// chunk from or return a chunk to the pool.  the pool owns all of the chunks
+// it has ever handed out and frees them when it is destroyed.
+template <typename type_t, uint32_t size_>
+struct n3d_chunk_pool_t {
+
+    typedef n3d_chunk_t<type_t, size_> chunk_t;
+
+    n3d_chunk_pool_t()
+        : used_(0)
+    {
+    }
+
+    n3d_chunk_pool_t(const n3d_chunk_pool_t&) = delete;
+
+    // take an empty chunk, growing the pool if there are none free
+    chunk_t* alloc()
+    {
+        n3d_scope_spinlock_t guard(lock_);
+        chunk_t* chunk = nullptr;
+        if (free_.empty()) {
+            chunk_.emplace_back(new chunk_t);
+            chunk = chunk_.back().get();
+        } else {
+            chunk = free_.back();
+            free_.pop_back();
+        }
+        chunk->count_.store(0, std::memory_order_relaxed);
+        chunk->next_.store(nullptr, std::memory_order_relaxed);
+        ++used_;
+        return chunk;
+    }
+
+    // return a chunk which has been fully consumed
+    void free(chunk_t* chunk)
+    {
+        n3d_scope_spinlock_t guard(lock_);
+        free_.push_back(chunk);
+        --used_;
+    }
+
+    // number of chunks currently held by pipes
+    long used() const
+    {
+        return used_;
+    }
+
+    // size of a chunk in bytes
+    static size_t chunk_bytes()
+    {
+        return sizeof(chunk_t);
+    }
+
+protected:
+    n3d_spinlock_t lock_;
+    std::vector<std::unique_ptr<chunk_t>> chunk_;
+    std::vector<chunk_t*> free_;
+    n3d_atomic_t used_;
+};
+
+// an unbounded pipe built from a linked list of chunks.  like n3d_pipe_t it
+// is suitable for only ONE producer and ONE consumer, but push never fails.
+// when the last chunk is full the producer links on a new one from the pool,
+// and the consumer returns each chunk to the pool once it has drained it, so
+// memory use follows the number of items actually in flight.
+template <typename type_t, uint32_t size_ = 256>
+struct n3d_chunk_pipe_t {
+
+    typedef n3d_chunk_pool_t<type_t, size_> pool_t;
+    typedef n3d_chunk_t<type_t, size_> chunk_t;
+
+    n3d_chunk_pipe_t()
+        : pool_(nullptr)
+        , tail_(nullptr)
+        , head_(nullptr)
+        , read_(0)
+    {
+    }
+
+    n3d_chunk_pipe_t(const n3d_chunk_pipe_t&) = delete;
+
+    // attach to a pool and take the first chunk.  this must be done before
+    // the pipe is shared with another thread.
+    void init(pool_t* pool)
+    {
+        n3d_assert(pool && !pool_);
+        pool_ = pool;
+        head_ = tail_ = pool->alloc();
+        read_ = 0;
+    }
+
+    // called by the producer thread
+    void push(const type_t& in)
+    {
+        push_n(&in, 1);
+    }
+
+    // called by the consumer thread
+    bool pop(type_t& out)
+    {
+        return pop_n(&out, 1) == 1;
+    }
+
+    // called by the producer thread.  items are published once per chunk
+    // rather than one at a time.
+    void push_n(const type_t* in, uint32_t num)
+    {
+        while (num) {
+            chunk_t* chunk = tail_;
+            uint32_t count = chunk->count_.load(std::memory_order_relaxed);
+            if (count == size_) {
+                // the release store makes sure the new chunk is initialized
+                // before the consumer can follow the link
+                chunk_t* next = pool_->alloc();
+                chunk->next_.store(next, std::memory_order_release);
+                tail_ = chunk = next;
+                count = 0;
+            }
+            const uint32_t n = min2(num, size_ - count);
+            for (uint32_t i = 0; i < n; ++i) {
+                chunk->data_[count + i] = in[i];
+            }
+            // publish the items to the consumer
+            chunk->count_.store(count + n, std::memory_order_release);
+            in += n;
+            num -= n;
+        }
+    }
+
+    // called by the consumer thread.  pop up to num items and return the
+    // number popped, reading the producers count once per chunk.
+    uint32_t pop_n(type_t* out, uint32_t num)
+    {
+        uint32_t done = 0;
+        while (done < num) {
+            chunk_t* chunk = head_;
+            if (read_ == size_) {
+                // move on once the producer has linked the next chunk
+                chunk_t* next = chunk->next_.load(std::memory_order_acquire);
+                if (!next) {
+                    break;
+                }
+                head_ = next;
+                read_ = 0;
+                pool_->free(chunk);
+                chunk = next;
+            }
+            const uint32_t count = chunk->count_.load(std::memory_order_acquire);
+            if (read_ >= count) {
+                break;
+            }
+            const uint32_t n = min2(num - done, count - read_);
+            for (uint32_t i = 0; i < n; ++i) {
+                out[done + i] = chunk->data_[read_ + i];
+            }
+            read_ += n;
+            done += n;
+        }
+        return done;
+    }
+
+protected:
+    pool_t* pool_;
+    uint8_t pad0_[c_cache_line];
+
+    // chunk being written by the producer
+    chunk_t* tail_;
+    uint8_t pad1_[c_cache_line];
+
+    // chunk being read by the consumer
+    chunk_t* head_;
+    // read position within the head chunk
+    uint32_t read_;
+};
@@ -1,8 +1,10 @@
 // n3d_pipeline.cpp
 //   implement the vertex processing pipeline and clipping stages
 
+#include "../nano3d.h"
 #include "n3d_pipeline.h"
 #include "n3d_math.h"
+#include "n3d_triangle.h"
 #include "n3d_util.h"
 
 namespace {
@@ -66,6 +68,116 @@ bool is_backfacing(const vec4f_t& a, const vec4f_t& b, const vec4f_t& c)
     return ((*(const uint32_t*)&cross) & 0x80000000) == 0;
 }
 
+// planes which triangles are clipped against by n3d_clip_batch
+static const uint32_t c_clip_planes[] = {
+    e_clip_near,
+    e_guard_left,
+    e_guard_right,
+    e_guard_bottom,
+    e_guard_top,
+};
+
+// maximum number of vertices a clipped triangle can have
+static const uint32_t c_clip_max_verts = 3 + sizeof(c_clip_planes) / sizeof(uint32_t);
+
+// signed distance of a staged vertex from a clip plane, positive inside
+float plane_dist(const n3d_vertex_array_t& s, const uint32_t i, const uint32_t plane)
+{
+    const float x = s.x_[i], y = s.y_[i], z = s.z_[i], w = s.w_[i];
+    const float g = w * c_guard_band;
+    switch (plane) {
+    case e_clip_near:    return z + w;
+    case e_guard_left:   return x + g;
+    case e_guard_right:  return g - x;
+    case e_guard_bottom: return y + g;
+    case e_guard_top:    return g - y;
+    default:
+        n3d_assert(!"bad clip plane");
+        return 0.f;
+    }
+}
+
+// add a new vertex to the staging area, part way along an edge
+uint32_t split_edge(
+    n3d_vertex_array_t& s,
+    uint32_t& num_verts,
+    const uint32_t a,
+    const uint32_t b,
+    const float t,
+    const uint32_t flags)
+{
+    const uint32_t i = num_verts++;
+    if (s.x_.size() < num_verts) {
+        s.resize(num_verts);
+    }
+    s.x_[i] = n3d_lerp(t, s.x_[a], s.x_[b]);
+    s.y_[i] = n3d_lerp(t, s.y_[a], s.y_[b]);
+    s.z_[i] = n3d_lerp(t, s.z_[a], s.z_[b]);
+    s.w_[i] = n3d_lerp(t, s.w_[a], s.w_[b]);
+    if (flags & e_prepare_uv) {
+        s.u_[i] = n3d_lerp(t, s.u_[a], s.u_[b]);
+        s.v_[i] = n3d_lerp(t, s.v_[a], s.v_[b]);
+    }
+    if (flags & e_prepare_rgb) {
+        s.r_[i] = n3d_lerp(t, s.r_[a], s.r_[b]);
+        s.g_[i] = n3d_lerp(t, s.g_[a], s.g_[b]);
+        s.b_[i] = n3d_lerp(t, s.b_[a], s.b_[b]);
+    }
+    return i;
+}
+
+// clip a triangle against the planes it crosses and emit a triangle fan
+void clip_triangle(
+    n3d_vertex_array_t& s,
+    uint32_t& num_verts,
+    const uint32_t tri[3],
+    const uint32_t planes,
+    std::vector<uint32_t>& out,
+    const uint32_t flags)
+{
+    uint32_t poly[2][c_clip_max_verts];
+    uint32_t num = 3;
+    poly[0][0] = tri[0];
+    poly[0][1] = tri[1];
+    poly[0][2] = tri[2];
+
+    uint32_t src = 0;
+    for (const uint32_t plane : c_clip_planes) {
+        if (!(planes & plane))
+            continue;
+        const uint32_t* in = poly[src];
+        uint32_t* dst = poly[src ^ 1];
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < num; ++i) {
+            const uint32_t a = in[i];
+            const uint32_t b = in[(i + 1) % num];
+            const float da = plane_dist(s, a, plane);
+            const float db = plane_dist(s, b, plane);
+            // keep the start of the edge when its inside
+            if (da >= 0.f) {
+                dst[n++] = a;
+            }
+            // split the edge when it crosses the plane
+            if ((da >= 0.f) != (db >= 0.f)) {
+                dst[n++] = split_edge(s, num_verts, a, b, da / (da - db), flags);
+            }
+        }
+        n3d_assert(n <= c_clip_max_verts);
+        num = n;
+        src ^= 1;
+        if (num < 3)
+            return;
+    }
+
+    // emit a fan which keeps the original winding
+    const uint32_t* p = poly[src];
+    for (uint32_t i = 2; i < num; ++i) {
+        out.push_back(p[0]);
+        out.push_back(p[i - 1]);
+        out.push_back(p[i]);
+    }
+}
+
 } // namespace {}
 
 // transform from world space into device coordinates
@@ -195,3 +307,78 @@ void n3d_ndc_to_dc(
         p.y = (p.y + 1.f) * sy;
     }
 }
+
+bool n3d_bounds_visible(const n3d_bounds_t& b, const mat4f_t& m)
+{
+    // transform the box origin and its edges, so that each corner is just
+    // the origin plus some of the edges.
+    const float d[3] = { b.max_.x - b.min_.x, b.max_.y - b.min_.y, b.max_.z - b.min_.z };
+    float o[4], e[3][4];
+    for (uint32_t j = 0; j < 4; ++j) {
+        o[j] = b.min_.x * m(0, j) + b.min_.y * m(1, j) + b.min_.z * m(2, j) + m(3, j);
+        for (uint32_t k = 0; k < 3; ++k) {
+            e[k][j] = d[k] * m(k, j);
+        }
+    }
+    // and together the clip codes of all corners
+    uint32_t code = e_clip_frustum;
+    for (uint32_t i = 0; i < 8 && code; ++i) {
+        float c[4] = { o[0], o[1], o[2], o[3] };
+        for (uint32_t k = 0; k < 3; ++k) {
+            if (i & (1 << k)) {
+                c[0] += e[k][0], c[1] += e[k][1], c[2] += e[k][2], c[3] += e[k][3];
+            }
+        }
+        const float x = c[0], y = c[1], z = c[2], w = c[3];
+        code &= ((x < -w) ? e_clip_left   : 0) | ((x > w) ? e_clip_right : 0) |
+                ((y < -w) ? e_clip_bottom : 0) | ((y > w) ? e_clip_top   : 0) |
+                ((z < -w) ? e_clip_near   : 0) | ((z > w) ? e_clip_far   : 0);
+    }
+    return code == 0;
+}
+
+uint32_t n3d_clip_batch(
+    n3d_vertex_array_t& stage,
+    uint32_t& num_verts,
+    const uint32_t* local,
+    const uint32_t num_tris,
+    std::vector<uint32_t>& out,
+    const uint32_t flags,
+    n3d_stats_t& stats)
+{
+    // planes which triangles must be clipped against
+    static const uint32_t c_clip_mask = e_clip_near | e_guard_band;
+
+    stage.clip_codes(num_verts, c_guard_band);
+    const uint32_t* code = stage.code_.data();
+
+    out.clear();
+    for (uint32_t i = 0; i < num_tris; ++i) {
+        const uint32_t* tri = local + i * 3;
+        const uint32_t c0 = code[tri[0]];
+        const uint32_t c1 = code[tri[1]];
+        const uint32_t c2 = code[tri[2]];
+
+        // all points rejected by a frustum plane so skip triangle
+        if (c0 & c1 & c2 & e_clip_frustum) {
+            ++stats.culled_frustum_;
+            continue;
+        }
+
+        const uint32_t planes = (c0 | c1 | c2) & c_clip_mask;
+        if (planes) {
+            // note: this may grow the staging area
+            const size_t size = out.size();
+            clip_triangle(stage, num_verts, tri, planes, out, flags);
+            code = stage.code_.data();
+            if (out.size() == size) {
+                ++stats.culled_frustum_;
+            }
+        } else {
+            out.push_back(tri[0]);
+            out.push_back(tri[1]);
+            out.push_back(tri[2]);
+        }
+    }
+    return uint32_t(out.size() / 3);
+}
@@ -1,5 +1,9 @@
+#pragma once
+#include <vector>
+
 #include "n3d_decl.h"
 #include "n3d_forward.h"
+#include "n3d_vertex_array.h"
 
 // the n3d_pipeline is responsible for transforming vertices through each stage
 // of the geometry pipeline:
@@ -9,6 +13,11 @@
 // - perspective division
 // - normalised device coordinates to frame buffer mapping
 
+// size of the guard band relative to the view frustum.  triangles which stay
+// inside the guard band do not need to be clipped to the sides of the view
+// frustum as the rasterizers will scissor them to the bins.
+static const float c_guard_band = 8.f;
+
 // transform vertex
 void n3d_transform(
     n3d_vertex_t * v, 
@@ -30,3 +39,25 @@ void n3d_ndc_to_dc(
     n3d_vertex_t vert[4], 
     const uint32_t num_verts, 
     const vec2f_t sf);
+
+// test if an object space bounding box may be visible after transformation
+// into homogeneous clip space by m.  returns false when all of its corners lie
+// outside of the same view frustum plane.
+bool n3d_bounds_visible(
+    const n3d_bounds_t& bounds,
+    const mat4f_t& m);
+
+// cull and clip a list of triangles held in the staging area in homogeneous
+// clip space.  triangles fully outside the view frustum are dropped and those
+// crossing the near plane or leaving the guard band are clipped, which may add
+// vertices to the end of the staging area.  the triangles which survive are
+// written to out as staging slots in their original order and the number of
+// them is returned.  culled triangles are counted in stats.
+uint32_t n3d_clip_batch(
+    n3d_vertex_array_t& stage,
+    uint32_t& num_verts,
+    const uint32_t* local,
+    const uint32_t num_tris,
+    std::vector<uint32_t>& out,
+    const uint32_t flags,
+    n3d_stats_t& stats);
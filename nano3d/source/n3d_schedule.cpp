@@ -4,135 +4,367 @@
 #include "n3d_schedule.h"
 #include "n3d_atomic.h"
 #include "n3d_bin.h"
+#include "n3d_cpu.h"
+#include "n3d_util.h"
 #include <stdint.h>
 
+// a worker is only moved a bin when the gap between the slowest and fastest
+// worker is more than 1/c_balance_slack of the slowest workers time
+static const uint64_t c_balance_slack = 8;
+
+// node of the host thread, which steals from any node
+static const uint32_t c_no_node = ~0u;
+
+// limits for the number of times an idle worker yields before it parks
+static const uint32_t c_spin_min = 16;
+static const uint32_t c_spin_max = 4096;
+
 struct n3d_worker_t : public n3d_thread_t {
 
-    n3d_worker_t(n3d_schedule_t& schedule)
+    n3d_worker_t(n3d_schedule_t& schedule, uint32_t slot, int32_t cpu)
         : schedule_(schedule)
+        , slot_(slot)
+        , cpu_(cpu)
+        , started_(false)
+        , idle_(0)
+        , spin_(c_spin_min)
     {
     }
 
 protected:
     n3d_schedule_t& schedule_;
+    const uint32_t slot_;
+    // cpu to pin this worker to, or -1 to leave it free
+    const int32_t cpu_;
+    bool started_;
+    // number of times in a row we have found nothing to do
+    uint32_t idle_;
+    // number of times to spin before parking
+    uint32_t spin_;
 
-    virtual void thread_func() override
+    // do one piece of work if there is any
+    bool work()
     {
-        n3d_bin_t* bin = schedule_.get_work(this);
+        // help out with any job or tasks before looking for bins
+        if (schedule_.run_job(slot_)) {
+            return true;
+        }
+        if (schedule_.run_tasks(slot_)) {
+            return true;
+        }
+        n3d_bin_t* bin = schedule_.get_work(slot_);
         if (bin) {
             n3d_bin_process(bin);
+            return true;
+        }
+        return false;
+    }
+
+    virtual void thread_func() override
+    {
+        // pin ourself before touching any memory so that it lands on our node
+        if (!started_) {
+            if (cpu_ >= 0) {
+                n3d_pin_thread(uint32_t(cpu_));
+            }
+            schedule_.touch(slot_);
+            started_ = true;
+            return;
+        }
+
+        const long signal = schedule_.signal();
+        if (work()) {
+            // work turned up while we were spinning so spin for longer next
+            // time rather than paying to park and wake
+            if (idle_) {
+                spin_ = min2(spin_ * 2, c_spin_max);
+            }
+            idle_ = 0;
+            return;
+        }
+        if (++idle_ < spin_) {
+            n3d_yield();
+            return;
         }
+        // nothing turned up so spin for less next time and sleep until
+        // there is something to do
+        spin_ = max2(spin_ / 2, c_spin_min);
+        idle_ = 0;
+        schedule_.park(signal);
     }
 };
 
-void n3d_schedule_t::next_frame()
+uint32_t n3d_schedule_t::submit()
 {
-    reshuffle();
+    // the counter is shared with the frame before last
+    const uint32_t frame = submitted_;
+    n3d_assert(frame < 2 || frame_is_done(frame - 2));
 
-    n3d_assert(counter_ == 0);
-
-    const long new_val = (long)bins_.size();
-    const long old_val = n3d_atomic_xchg(counter_, new_val);
+    // only the active bins will present
+    long new_val = 0;
+    for (n3d_bin_t* bin : bins_) {
+        new_val += bin->active_ ? 1 : 0;
+    }
+    const long old_val = n3d_atomic_xchg(counter_[frame & 1], new_val);
 
     n3d_assert(old_val == 0);
 
-    n3d_atomic_inc(frame_num_);
+    ++submitted_;
+    return frame;
 }
 
 void n3d_schedule_t::add(n3d_bin_t* bin, uint32_t num)
 {
     num_bins_ += num;
-    counter_ += num;
 
     for (uint32_t i = 0; i < num; ++i) {
         bins_.push_back(&bin[i]);
-        bin[i].counter_ = &counter_;
+        bin[i].counter_ = counter_;
+        bin[i].schedule_ = this;
     }
 }
 
-void n3d_schedule_t::reshuffle()
+void n3d_schedule_t::balance()
 {
     n3d_assert(thread_.size() == num_threads_);
 
-    if (num_threads_) {
-        n3d_assert(thread_map_.get());
-        n3d_assert(num_bins_);
+    if (num_threads_ < 2) {
+        for (n3d_bin_t* bin : bins_) {
+            bin->time_ = 0;
+        }
+        return;
+    }
 
-        // todo: make some kind of priority heap here based on bin execution cost
+    // find how long each worker spent on the bins it owns
+    load_.assign(num_threads_, 0);
+    for (n3d_bin_t* bin : bins_) {
+        load_[bin->owner_ - 1] += bin->time_;
+    }
+    uint32_t slow = 0;
+    for (uint32_t i = 1; i < num_threads_; ++i) {
+        slow = (load_[i] > load_[slow]) ? i : slow;
+    }
+    // only move bins within a node so each keeps to its region of the screen
+    uint32_t fast = slow;
+    for (uint32_t i = 0; i < num_threads_; ++i) {
+        if (node_[i + 1] == node_[slow + 1] && load_[i] < load_[fast]) {
+            fast = i;
+        }
+    }
 
-        uint32_t stride = num_bins_ / num_threads_;
+    // leave things be unless the workers are well out of balance, so that
+    // bins dont flip back and forth with small changes in the frame
+    const uint64_t gap = load_[slow] - load_[fast];
+    if (gap > (load_[slow] / c_balance_slack)) {
 
-        for (uint32_t i = 0; i < num_threads_; ++i) {
-            thread_map_.get()[i] = i * stride;
+        // moving a bin which took half of the gap would even them out, and
+        // any bin which took less than the whole gap is an improvement
+        n3d_bin_t* best = nullptr;
+        uint64_t best_err = gap;
+        for (n3d_bin_t* bin : bins_) {
+            if (bin->owner_ != slow + 1 || !bin->time_ || bin->time_ >= gap)
+                continue;
+            const uint64_t half = gap / 2;
+            const uint64_t err = (bin->time_ > half) ? bin->time_ - half : half - bin->time_;
+            if (err < best_err) {
+                best = bin;
+                best_err = err;
+            }
+        }
+        if (best) {
+            best->owner_ = fast + 1;
         }
     }
+
+    for (n3d_bin_t* bin : bins_) {
+        bin->time_ = 0;
+    }
 }
 
-bool n3d_schedule_t::start(const uint32_t max_threads)
+bool n3d_schedule_t::start(const uint32_t max_threads, const bool pin)
 {
+    n3d_atomic_xchg(stopping_, 0);
+    n3d_atomic_xchg(touched_, 0);
+
+    // a ready queue for the host thread and each worker
+    queue_.clear();
+    seed_.clear();
+    for (uint32_t i = 0; i < max_threads + 1; ++i) {
+        queue_.emplace_back(new queue_t);
+        seed_.push_back(0x9e3779b9u * (i + 1));
+    }
+    node_.assign(max_threads + 1, c_no_node);
+
     if (max_threads) {
         // todo: lets remove this in favour of thread_.size()
         num_threads_ = max_threads;
 
-        // create the thread to bin mapping
-        thread_map_.reset(new uint32_t[max_threads]);
+        // spread the workers evenly over all of the cpus, which are listed in
+        // node order, so that workers on the same node have adjacent slots
+        std::vector<std::vector<uint32_t>> nodes;
+        n3d_cpu_nodes(nodes);
+        std::vector<uint32_t> cpu_node, cpu_id;
+        for (uint32_t n = 0; n < nodes.size(); ++n) {
+            for (uint32_t cpu : nodes[n]) {
+                cpu_node.push_back(n);
+                cpu_id.push_back(cpu);
+            }
+        }
+        std::vector<int32_t> worker_cpu(max_threads, -1);
+        const uint32_t num_cpus = uint32_t(cpu_id.size());
+        for (uint32_t i = 0; i < max_threads; ++i) {
+            const uint32_t c = uint32_t((uint64_t(i) * num_cpus) / max_threads);
+            node_[i + 1] = cpu_node[c];
+            worker_cpu[i] = pin ? int32_t(cpu_id[c]) : -1;
+        }
+
+        // give each worker a contiguous run of the bins in use, so each node
+        // owns a region of the screen.  idle quadrant bins take the owner of
+        // their cell when it is split.
+        uint32_t num_active = 0;
+        for (n3d_bin_t* bin : bins_) {
+            num_active += bin->active_ ? 1 : 0;
+        }
+        uint32_t index = 0;
+        for (n3d_bin_t* bin : bins_) {
+            bin->owner_ = 1;
+            if (bin->active_) {
+                bin->owner_ += uint32_t((uint64_t(index++) * max_threads) / num_active);
+            }
+        }
 
         // create a bunch of worker threads
         for (uint32_t i = 0; i < max_threads; ++i) {
-            thread_.emplace_back(new n3d_worker_t(*this));
+            thread_.emplace_back(new n3d_worker_t(*this, i + 1, worker_cpu[i]));
         }
 
-        // shuffle the thread to bin mapping
-        reshuffle();
-
         // launch all of the workers
         for (auto& thread : thread_) {
             thread->start();
         }
+
+        // wait for the workers to touch their memory so that the host
+        // cant get there first
+        while (touched_ < long(max_threads)) {
+            n3d_yield();
+        }
     } else {
-        //todo: do we need to reshuffle?
+        // the host thread owns every bin
+        for (n3d_bin_t* bin : bins_) {
+            bin->owner_ = 0;
+        }
     }
 
     return true;
 }
 
-n3d_bin_t* n3d_schedule_t::get_work(n3d_thread_t* thread)
+void n3d_schedule_t::touch(uint32_t slot)
+{
+    for (n3d_bin_t* bin : bins_) {
+        if (bin->active_ && bin->owner_ == slot) {
+            n3d_bin_touch(bin);
+        }
+    }
+    n3d_atomic_inc(touched_);
+}
+
+void n3d_schedule_t::ready(n3d_bin_t* bin)
 {
-    // note: thread may be nullptr if its the main thread requesting work
-    //    n3d_assert(thread_map_.get());
+    n3d_assert(bin && bin->owner_ < queue_.size());
+    queue_t& queue = *queue_[bin->owner_];
+    {
+        n3d_scope_spinlock_t guard(queue.lock_);
+        queue.bin_.push_back(bin);
+        n3d_atomic_inc(queue.size_);
+    }
+    wake(false);
+}
+
+void n3d_schedule_t::park(long signal)
+{
+    std::unique_lock<std::mutex> guard(park_mutex_);
+    // note: parked_ is raised before checking the signal so that a waker
+    //       which moves the signal on after this check will see us.
+    n3d_atomic_inc(parked_);
+    while (signal_ == signal && !stopping_) {
+        park_cond_.wait(guard);
+    }
+    n3d_atomic_dec(parked_);
+}
+
+void n3d_schedule_t::wake(bool all)
+{
+    n3d_atomic_inc(signal_);
+    // only pay for the mutex when someone is parked
+    if (parked_) {
+        std::lock_guard<std::mutex> guard(park_mutex_);
+        if (all) {
+            park_cond_.notify_all();
+        } else {
+            park_cond_.notify_one();
+        }
+    }
+}
 
-    // if the counter is 0 we know there is no work to do
-    if (counter_ == 0) {
+n3d_bin_t* n3d_schedule_t::take(queue_t& queue, bool front)
+{
+    // check without taking the lock so idle threads dont fight over it
+    if (!queue.size_) {
+        return nullptr;
+    }
+    n3d_scope_spinlock_t guard(queue.lock_);
+    if (queue.bin_.empty()) {
         return nullptr;
     }
+    n3d_bin_t* bin = nullptr;
+    if (front) {
+        bin = queue.bin_.front();
+        queue.bin_.pop_front();
+    } else {
+        bin = queue.bin_.back();
+        queue.bin_.pop_back();
+    }
+    n3d_atomic_dec(queue.size_);
+    return bin;
+}
 
-    // try at max all bins
-    for (uint32_t i = 0; i < num_bins_; ++i) {
+n3d_bin_t* n3d_schedule_t::get_work(uint32_t slot)
+{
+    n3d_assert(slot < queue_.size());
 
-        n3d_bin_t* b = nullptr;
+    // note: if a bin is already locked then another thread is processing it
+    //       and we can drop it and move on.  that thread checks the queued
+    //       flag again after unlocking, so commands sent while it held the
+    //       lock are still processed.
+    n3d_bin_t* bin = nullptr;
 
-        // if we are a worker thread
-        if (thread) {
-            n3d_assert(num_threads_);
-            uint32_t id = thread->get_id() % num_threads_;
-            uint32_t& item = thread_map_.get()[id];
-            b = bins_[(item++) % num_bins_];
-        }
-        // if we are the host thread
-        else {
-            b = bins_[i];
+    // take the oldest bin from our own queue first
+    while ((bin = take(*queue_[slot], true))) {
+        if (bin->lock_.try_lock()) {
+            return bin;
         }
-        n3d_assert(b);
-        // try to acquire this bin
-        if (b->lock_.try_lock()) {
-            // if this frame is complete
-            if (b->frame_>frame_num_) {
-                // unlock and skip over
-                b->lock_.unlock();
+    }
+
+    // otherwise steal the newest bin from another thread, starting with a
+    // random victim so that thieves spread out.  look on our own node first
+    // as its bins are in nearby memory.
+    const uint32_t num = uint32_t(queue_.size());
+    uint32_t& seed = seed_[slot];
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    const uint32_t first = seed % num;
+    const uint32_t node = node_[slot];
+    for (uint32_t pass = (node == c_no_node) ? 1 : 0; pass < 2; ++pass) {
+        for (uint32_t i = 0; i < num; ++i) {
+            const uint32_t victim = (first + i) % num;
+            if (victim == slot || ((node_[victim] == node) != (pass == 0))) {
+                continue;
             }
-            else {
-                // bin needs processing, leave locked and return it
-                return b;
+            while ((bin = take(*queue_[victim], false))) {
+                if (bin->lock_.try_lock()) {
+                    return bin;
+                }
             }
         }
     }
@@ -141,14 +373,28 @@ n3d_bin_t* n3d_schedule_t::get_work(n3d_thread_t* thread)
     return nullptr;
 }
 
-bool n3d_schedule_t::frame_is_done() const
+bool n3d_schedule_t::frame_is_done(uint32_t frame) const
 {
-    // if there are no more bins left to process
-    return counter_ == 0;
+    n3d_assert(frame < submitted_);
+    // a counter is reused two frames on, by which time its frame was done
+    if (submitted_ - frame > 2) {
+        return true;
+    }
+    // if there are no more bins left to present it
+    return n3d_atomic_load(counter_[frame & 1]) == 0;
 }
 
 void n3d_schedule_t::stop()
 {
+    // finish any tasks which were not joined
+    while (tasks_active_) {
+        join_tasks(tasks_.front());
+    }
+
+    // wake any parked workers and keep them from parking again
+    n3d_atomic_xchg(stopping_, 1);
+    wake(true);
+
     // kill all worker threads
     for (auto& thread : thread_) {
         n3d_assert(thread);
@@ -156,3 +402,151 @@ void n3d_schedule_t::stop()
     }
     thread_.clear();
 }
+
+void n3d_schedule_t::run(const n3d_job_t& job)
+{
+    n3d_assert(job.func_);
+
+    // no point waking the workers when there is nothing to share
+    if (thread_.empty() || job.count_ <= 1) {
+        for (uint32_t i = 0; i < job.count_; ++i) {
+            job.func_(job.user_, i, 0);
+        }
+        return;
+    }
+
+    // publish the job to the workers
+    n3d_assert(!job_active_);
+    job_ = job;
+    n3d_atomic_xchg(job_next_, 0);
+    n3d_atomic_xchg(job_active_, 1);
+    wake(true);
+
+    // process items until they have all been handed out
+    run_job(0);
+
+    // retract the job and wait for the workers to finish their last items
+    n3d_atomic_xchg(job_active_, 0);
+    while (job_busy_) {
+        n3d_yield();
+    }
+}
+
+bool n3d_schedule_t::run_job(uint32_t slot)
+{
+    // note: job_busy_ must be raised before checking job_active_ so that the
+    //       host thread can not retract the job while we are using it.
+    bool worked = false;
+    n3d_atomic_inc(job_busy_);
+    if (job_active_) {
+        long item;
+        while ((item = n3d_atomic_inc(job_next_)) < long(job_.count_)) {
+            job_.func_(job_.user_, uint32_t(item), slot);
+            worked = true;
+        }
+    }
+    n3d_atomic_dec(job_busy_);
+    return worked;
+}
+
+n3d_task_set_t* n3d_schedule_t::start_tasks(const n3d_job_t& job)
+{
+    n3d_assert(job.func_);
+
+    n3d_task_set_t* tasks = nullptr;
+    {
+        n3d_scope_spinlock_t guard(tasks_lock_);
+        if (task_free_.empty()) {
+            task_pool_.emplace_back(new n3d_task_set_t);
+            task_free_.push_back(task_pool_.back().get());
+        }
+        tasks = task_free_.back();
+        task_free_.pop_back();
+
+        tasks->job_ = job;
+        n3d_atomic_xchg(tasks->next_, 0);
+        n3d_assert(tasks->busy_ == 0);
+        tasks_.push_back(tasks);
+        n3d_atomic_inc(tasks_active_);
+    }
+
+    // the host runs whatever is left when it joins so only the workers
+    // need to know
+    if (!thread_.empty()) {
+        wake(true);
+    }
+    return tasks;
+}
+
+bool n3d_schedule_t::run_tasks(uint32_t slot)
+{
+    if (!tasks_active_) {
+        return false;
+    }
+
+    // find the oldest task set with items still to hand out
+    n3d_task_set_t* tasks = nullptr;
+    {
+        n3d_scope_spinlock_t guard(tasks_lock_);
+        for (n3d_task_set_t* t : tasks_) {
+            if (t->next_ < long(t->job_.count_)) {
+                tasks = t;
+                // note: busy_ is raised under the lock so the set can not be
+                //       released while we are using it.
+                n3d_atomic_inc(tasks->busy_);
+                break;
+            }
+        }
+    }
+    if (!tasks) {
+        return false;
+    }
+
+    bool worked = false;
+    const n3d_job_t& job = tasks->job_;
+    long item;
+    while ((item = n3d_atomic_inc(tasks->next_)) < long(job.count_)) {
+        job.func_(job.user_, uint32_t(item), slot);
+        worked = true;
+    }
+    n3d_atomic_dec(tasks->busy_);
+    return worked;
+}
+
+void n3d_schedule_t::join_tasks(n3d_task_set_t* tasks)
+{
+    n3d_assert(tasks);
+
+    // run the items which are still to be handed out
+    const n3d_job_t& job = tasks->job_;
+    long item;
+    while ((item = n3d_atomic_inc(tasks->next_)) < long(job.count_)) {
+        job.func_(job.user_, uint32_t(item), 0);
+    }
+
+    // retire the set so no more workers pick it up
+    {
+        n3d_scope_spinlock_t guard(tasks_lock_);
+        for (size_t i = 0; i < tasks_.size(); ++i) {
+            if (tasks_[i] == tasks) {
+                tasks_.erase(tasks_.begin() + i);
+                n3d_atomic_dec(tasks_active_);
+                break;
+            }
+        }
+    }
+
+    // wait for the workers to finish their last items, rasterizing in the
+    // meantime
+    while (n3d_atomic_load(tasks->busy_)) {
+        n3d_bin_t* bin = get_work(0);
+        if (bin) {
+            n3d_bin_process(bin);
+        } else {
+            n3d_yield();
+        }
+    }
+
+    n3d_scope_spinlock_t guard(tasks_lock_);
+    task_free_.push_back(tasks);
+}
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include "n3d_atomic.h"
@@ -8,17 +11,75 @@
 #include "n3d_thread.h"
 
 // the n3d_schedule_t is responsible for managing worker threads and allocating
-// bins to them for processing. the scheduler can perform load balancing to
-// keep bin execution cost distributed across all threads while trying to
-// maintain worker cache coherency. the current code is not quite there yet and
-// will need to be looked at closely when optimising.
+// bins to them for processing. each bin is owned by a worker, and when a bin
+// is sent commands while idle it is queued with its owner.  workers process
+// their own queue first, so that bins stay in the same workers cache from
+// frame to frame, and only steal from another thread when theirs is empty.
+// the time spent on each bin is measured and between frames a bin is moved
+// from the slowest worker to the fastest, so the load evens out over a number
+// of frames.
+//
+// workers which run out of work spin for a while and then park until they are
+// signaled, which happens whenever a bin is queued or a job is started.
+//
+// workers are spread over the numa nodes of the machine in order, so that the
+// contiguous runs of bins they are given keep each node to its own region of
+// the screen.  bins are only balanced between workers on the same node and
+// thieves look on their own node first.  each worker first touches the depth
+// memory of its bins so that it is placed on its node.
+//
+// the scheduler can also run a job, a number of independent work items which
+// are shared out between the worker threads and the host thread.  this lets the
+// front end make use of the workers while it is feeding the bins.
+//
+// user task sets are jobs which are started without waiting for them.  the
+// workers pick them up between jobs and bins, and the host thread runs any
+// items left over when it joins them, so the application can use the same
+// threads without oversubscribing the machine.
+
+// a parallel job
+struct n3d_job_t {
+    // process one work item.  slot identifies the calling thread and is 0 for
+    // the host thread and 1 + worker index for the worker threads.
+    void (*func_)(void* user, uint32_t item, uint32_t slot);
+    // user data passed to func_
+    void* user_;
+    // number of work items
+    uint32_t count_;
+};
+
+// a job started without waiting, which is joined later
+struct n3d_task_set_t {
+
+    n3d_task_set_t()
+        : job_()
+        , next_(0)
+        , busy_(0)
+    {
+    }
+
+    n3d_job_t job_;
+    // next work item to hand out
+    n3d_atomic_t next_;
+    // number of threads currently running its items
+    n3d_atomic_t busy_;
+};
 
 struct n3d_schedule_t {
 
     n3d_schedule_t()
-        : bins_()
-        , frame_num_(0)
-        , counter_(0)
+        : touched_(0)
+        , bins_()
+        , submitted_(0)
+        , counter_()
+        , job_()
+        , job_active_(0)
+        , job_next_(0)
+        , job_busy_(0)
+        , tasks_active_(0)
+        , signal_(0)
+        , parked_(0)
+        , stopping_(0)
         , num_bins_(0)
         , num_threads_(0)
     {
@@ -27,32 +88,143 @@ struct n3d_schedule_t {
     // add a list of bins to the scheduler
     void add(n3d_bin_t* bin, uint32_t num);
 
-    // return a bin that needs more work.  the thread parameter is a hint for
-    // optimization and can be nullptr
-    n3d_bin_t* get_work(n3d_thread_t* thread);
+    // return a locked bin that needs more work, or nullptr if there is none.
+    // slot is 0 for the host thread and 1 + worker index for the workers.
+    n3d_bin_t* get_work(uint32_t slot);
 
-    void next_frame();
+    // queue a bin which has been sent commands with the thread that owns it
+    void ready(n3d_bin_t* bin);
 
-    // check if all bins have been processed for this frame
-    bool frame_is_done() const;
+    // count the bins which must present the frame being submitted and
+    // return its number.  the frame two before it must be done.
+    uint32_t submit();
 
-    bool start(const uint32_t max_threads);
+    // check if all bins have presented a submitted frame
+    bool frame_is_done(uint32_t frame) const;
+
+    // number of frames submitted so far
+    uint32_t submitted() const
+    {
+        return submitted_;
+    }
+
+    // move a bin from the slowest worker to the fastest.  this should only
+    // be called when no frames are in flight.
+    void balance();
+
+    // start the worker threads, optionally pinning each to its own cpu
+    bool start(const uint32_t max_threads, const bool pin);
 
     void stop();
 
-protected:
-    // reshuffle the bin map
-    void reshuffle();
+    // run a job to completion.  only the host thread may call this and it
+    // will process work items itself while it waits.
+    void run(const n3d_job_t& job);
 
-    // todo: revise this an have a full thread -> bin map
+    // process items from the active job if there is one.  returns true if
+    // any work was done.
+    bool run_job(uint32_t slot);
 
-    std::unique_ptr<uint32_t> thread_map_;
+    // start a task set and return without waiting for it.  only the host
+    // thread may call this.
+    n3d_task_set_t* start_tasks(const n3d_job_t& job);
+
+    // process items from the oldest task set with some left.  returns true
+    // if any work was done.
+    bool run_tasks(uint32_t slot);
+
+    // run the rest of a task set and wait for the workers to finish theirs.
+    // the task set is released and must not be used again.
+    void join_tasks(n3d_task_set_t* tasks);
+
+    // the current signal count.  a worker reads this before it last checks
+    // for work and then parks with it.
+    long signal() const
+    {
+        return signal_;
+    }
+
+    // block the calling worker until the signal count moves on from the
+    // value it read, so that no signal can be missed between the two.
+    void park(long signal);
+
+    // signal that there is new work, waking one parked worker or all of them
+    void wake(bool all);
+
+    // called by each worker when it starts to first touch the memory of the
+    // bins it owns
+    void touch(uint32_t slot);
+
+    // number of worker threads
+    uint32_t num_threads() const
+    {
+        return num_threads_;
+    }
+
+protected:
+    // bins waiting to be processed by one thread
+    struct queue_t {
+
+        queue_t()
+            : size_(0)
+        {
+        }
+
+        n3d_spinlock_t lock_;
+        std::deque<n3d_bin_t*> bin_;
+        // number of queued bins, which can be checked without the lock
+        n3d_atomic_t size_;
+    };
+
+    // take a bin from a queue, from the front for the owner and from the
+    // back for thieves
+    n3d_bin_t* take(queue_t& queue, bool front);
+
+    // ready bins for each thread slot
+    std::vector<std::unique_ptr<queue_t>> queue_;
+    // random state each thread uses to pick a victim to steal from
+    std::vector<uint32_t> seed_;
+    // numa node of each thread slot, the host thread has none
+    std::vector<uint32_t> node_;
+    // number of workers which have touched their bins
+    n3d_atomic_t touched_;
+    // time spent on the bins owned by each worker last frame
+    std::vector<uint64_t> load_;
 
     std::vector<n3d_bin_t*> bins_;
     std::vector<std::unique_ptr<n3d_thread_t>> thread_;
 
-    n3d_atomic_t frame_num_;
-    n3d_atomic_t counter_;
+    // number of frames submitted
+    uint32_t submitted_;
+    // bins still to present the last even and odd numbered frames
+    n3d_atomic_t counter_[2];
+
+    // the active job
+    n3d_job_t job_;
+    // set while workers may pick up items from job_
+    n3d_atomic_t job_active_;
+    // next work item to hand out
+    n3d_atomic_t job_next_;
+    // number of threads currently inside run_job()
+    n3d_atomic_t job_busy_;
+
+    // task sets which have not been joined, oldest first
+    n3d_spinlock_t tasks_lock_;
+    std::vector<n3d_task_set_t*> tasks_;
+    // number of entries in tasks_, which can be checked without the lock
+    n3d_atomic_t tasks_active_;
+    // all task sets, and those which are free to use
+    std::vector<std::unique_ptr<n3d_task_set_t>> task_pool_;
+    std::vector<n3d_task_set_t*> task_free_;
+
+    // parked workers wait on this until the signal count changes
+    std::mutex park_mutex_;
+    std::condition_variable park_cond_;
+    n3d_atomic_t signal_;
+    // number of workers parked or about to park
+    n3d_atomic_t parked_;
+    // set while the workers are being stopped so they cant park again
+    n3d_atomic_t stopping_;
 
     // todo: replace these with std::vector.size()
     uint32_t num_bins_;
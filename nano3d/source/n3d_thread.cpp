@@ -7,6 +7,15 @@
 #include "n3d_types.h"
 #include <thread>
 
+#if defined(_MSC_VER)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 struct n3d_thread_t::detail_t {
 
     static n3d_atomic_t next_id_;
@@ -84,6 +93,25 @@ void n3d_yield()
     std::this_thread::yield();
 }
 
+bool n3d_pin_thread(uint32_t cpu)
+{
+#if defined(_MSC_VER)
+    if (cpu >= 64)
+        return false;
+    return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1ull << cpu)) != 0;
+#elif defined(__linux__)
+    if (cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
 uint32_t n3d_thread_t::get_id() const
 {
     detail_t& d_ = *(detail_);
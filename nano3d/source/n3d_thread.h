@@ -12,6 +12,10 @@
 // relinquish a threads timeslice
 void n3d_yield();
 
+// pin the calling thread to a logical cpu.  returns false if this is not
+// supported on the current platform.
+bool n3d_pin_thread(uint32_t cpu);
+
 // abstract system thread
 struct n3d_thread_t {
 
@@ -1,3 +1,6 @@
+#include <immintrin.h>
+
+#include "n3d_cpu.h"
 #include "n3d_util.h"
 #include "n3d_triangle.h"
 
@@ -7,6 +10,321 @@ constexpr float orient2d(const vec4f_t& a, const vec4f_t& b)
 {
     return (b.x - a.x) * (-a.y) - (b.y - a.y) * (-a.x);
 }
+
+// number of triangles set up at once by n3d_prepare_batch
+static const uint32_t c_setup_lanes = 8;
+// custom attributes which can be interpolated by n3d_prepare_batch (uv, rgb)
+static const uint32_t c_setup_attrs = 5;
+static const uint32_t c_setup_interp = e_attr_custom + c_setup_attrs;
+
+// SoA setup state for a group of triangles
+struct setup_t {
+    // vertex positions and attributes
+    alignas(32) float x_[3][c_setup_lanes];
+    alignas(32) float y_[3][c_setup_lanes];
+    alignas(32) float w_[3][c_setup_lanes];
+    alignas(32) float a_[c_setup_attrs][3][c_setup_lanes];
+    // triangle interpolants
+    alignas(32) float v_ [c_setup_interp][c_setup_lanes];
+    alignas(32) float sx_[c_setup_interp][c_setup_lanes];
+    alignas(32) float sy_[c_setup_interp][c_setup_lanes];
+    // triangle bounds
+    alignas(32) float min_x_[c_setup_lanes];
+    alignas(32) float min_y_[c_setup_lanes];
+    alignas(32) float max_x_[c_setup_lanes];
+    alignas(32) float max_y_[c_setup_lanes];
+    // range of custom attributes to interpolate
+    uint32_t attr_first_;
+    uint32_t attr_last_;
+    // lanes which are front facing and which cover a pixel centre
+    uint32_t front_;
+    uint32_t cover_;
+};
+
+// load a group of triangles from the staging area into setup_t
+void setup_gather(
+    setup_t& s,
+    const n3d_vertex_array_t& stage,
+    const uint32_t* local,
+    const uint32_t count)
+{
+    const n3d_vertex_array_t::array_t* attr[c_setup_attrs] = {
+        &stage.u_, &stage.v_, &stage.r_, &stage.g_, &stage.b_
+    };
+    for (uint32_t l = 0; l < c_setup_lanes; ++l) {
+        // unused lanes repeat the last triangle and are masked off later
+        const uint32_t* tri = local + 3 * min2(l, count - 1);
+        for (uint32_t k = 0; k < 3; ++k) {
+            const uint32_t j = tri[k];
+            s.x_[k][l] = stage.x_[j];
+            s.y_[k][l] = stage.y_[j];
+            s.w_[k][l] = stage.w_[j];
+            for (uint32_t a = s.attr_first_; a < s.attr_last_; ++a) {
+                s.a_[a][k][l] = (*attr[a])[j];
+            }
+        }
+    }
+}
+
+// write out the triangles which survived setup
+uint32_t setup_scatter(
+    const setup_t& s,
+    const uint32_t mask,
+    n3d_rasterizer_t::triangle_t* out)
+{
+    uint32_t written = 0;
+    for (uint32_t l = 0; l < c_setup_lanes; ++l) {
+        if (!(mask & (1u << l)))
+            continue;
+        n3d_rasterizer_t::triangle_t& tri = out[written++];
+        for (uint32_t i = 0; i < e_attr_custom; ++i) {
+            tri.v_ [i] = s.v_ [i][l];
+            tri.sx_[i] = s.sx_[i][l];
+            tri.sy_[i] = s.sy_[i][l];
+        }
+        for (uint32_t a = s.attr_first_; a < s.attr_last_; ++a) {
+            const uint32_t i = e_attr_custom + a;
+            tri.v_ [i] = s.v_ [i][l];
+            tri.sx_[i] = s.sx_[i][l];
+            tri.sy_[i] = s.sy_[i][l];
+        }
+        tri.min_.x = s.min_x_[l];
+        tri.min_.y = s.min_y_[l];
+        tri.max_.x = s.max_x_[l];
+        tri.max_.y = s.max_y_[l];
+    }
+    return written;
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ----
+// sse setup, 4 triangles at a time
+
+inline __m128 orient2d_x4(__m128 ax, __m128 ay, __m128 bx, __m128 by)
+{
+    const __m128 sign = _mm_set1_ps(-0.f);
+    return _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(bx, ax), _mm_xor_ps(ay, sign)),
+                      _mm_mul_ps(_mm_sub_ps(by, ay), _mm_xor_ps(ax, sign)));
+}
+
+// barycentric interpolate a per vertex value
+inline __m128 blerp_x4(const __m128 b[3], __m128 a0, __m128 a1, __m128 a2)
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(b[0], a0), _mm_mul_ps(b[1], a1)),
+                      _mm_mul_ps(b[2], a2));
+}
+
+// round down to an integer, sse2 has no floor instruction
+inline __m128 floor_x4(__m128 x)
+{
+    // truncation rounds negative values up so correct for that
+    const __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), _mm_set1_ps(1.f)));
+}
+
+uint32_t setup_x4(setup_t& s)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    uint32_t mask = 0;
+    s.front_ = 0;
+    s.cover_ = 0;
+
+    for (uint32_t l = 0; l < c_setup_lanes; l += 4) {
+        const __m128 x0 = _mm_load_ps(s.x_[0] + l);
+        const __m128 x1 = _mm_load_ps(s.x_[1] + l);
+        const __m128 x2 = _mm_load_ps(s.x_[2] + l);
+        const __m128 y0 = _mm_load_ps(s.y_[0] + l);
+        const __m128 y1 = _mm_load_ps(s.y_[1] + l);
+        const __m128 y2 = _mm_load_ps(s.y_[2] + l);
+
+        // the signed triangle area
+        const __m128 area = _mm_sub_ps(
+            _mm_mul_ps(_mm_sub_ps(x1, x0), _mm_sub_ps(y2, y0)),
+            _mm_mul_ps(_mm_sub_ps(x2, x0), _mm_sub_ps(y1, y0)));
+
+        // find triangle bounds
+        const __m128 min_x = _mm_min_ps(x0, _mm_min_ps(x1, x2));
+        const __m128 min_y = _mm_min_ps(y0, _mm_min_ps(y1, y2));
+        const __m128 max_x = _mm_max_ps(x0, _mm_max_ps(x1, x2));
+        const __m128 max_y = _mm_max_ps(y0, _mm_max_ps(y1, y2));
+        _mm_store_ps(s.min_x_ + l, min_x);
+        _mm_store_ps(s.min_y_ + l, min_y);
+        _mm_store_ps(s.max_x_ + l, _mm_add_ps(max_x, one));
+        _mm_store_ps(s.max_y_ + l, _mm_add_ps(max_y, one));
+
+        // check for back faces and triangles with no pixel centre inside
+        // their bounds, which is when the floor of the max is less than the min.
+        const uint32_t front = uint32_t(_mm_movemask_ps(_mm_cmpgt_ps(area, zero)));
+        const __m128 cx = _mm_cmpge_ps(floor_x4(max_x), min_x);
+        const __m128 cy = _mm_cmpge_ps(floor_x4(max_y), min_y);
+        const uint32_t cover = uint32_t(_mm_movemask_ps(_mm_and_ps(cx, cy)));
+        s.front_ |= front << l;
+        s.cover_ |= cover << l;
+        // skip the rest of the setup if nothing survived
+        if (!(front & cover))
+            continue;
+        mask |= (front & cover) << l;
+
+        // reciprocal of area for normalization
+        const __m128 ra = _mm_div_ps(one, area);
+
+        // find normalized barycentric coordinates
+        const __m128 v[3] = {
+            _mm_mul_ps(orient2d_x4(x1, y1, x2, y2), ra),
+            _mm_mul_ps(orient2d_x4(x2, y2, x0, y0), ra),
+            _mm_mul_ps(orient2d_x4(x0, y0, x1, y1), ra),
+        };
+        const __m128 sx[3] = {
+            _mm_mul_ps(_mm_sub_ps(y1, y2), ra),
+            _mm_mul_ps(_mm_sub_ps(y2, y0), ra),
+            _mm_mul_ps(_mm_sub_ps(y0, y1), ra),
+        };
+        const __m128 sy[3] = {
+            _mm_mul_ps(_mm_sub_ps(x2, x1), ra),
+            _mm_mul_ps(_mm_sub_ps(x0, x2), ra),
+            _mm_mul_ps(_mm_sub_ps(x1, x0), ra),
+        };
+        for (uint32_t i = 0; i < 3; ++i) {
+            _mm_store_ps(s.v_ [e_attr_b0 + i] + l, v[i]);
+            _mm_store_ps(s.sx_[e_attr_b0 + i] + l, sx[i]);
+            _mm_store_ps(s.sy_[e_attr_b0 + i] + l, sy[i]);
+        }
+
+        // calculate 1 / w for vertices
+        const __m128 w0 = _mm_div_ps(one, _mm_load_ps(s.w_[0] + l));
+        const __m128 w1 = _mm_div_ps(one, _mm_load_ps(s.w_[1] + l));
+        const __m128 w2 = _mm_div_ps(one, _mm_load_ps(s.w_[2] + l));
+
+        // interpolate 1 / w
+        _mm_store_ps(s.v_ [e_attr_w] + l, blerp_x4(v,  w0, w1, w2));
+        _mm_store_ps(s.sx_[e_attr_w] + l, blerp_x4(sx, w0, w1, w2));
+        _mm_store_ps(s.sy_[e_attr_w] + l, blerp_x4(sy, w0, w1, w2));
+
+        // interpolate attribute / w
+        for (uint32_t a = s.attr_first_; a < s.attr_last_; ++a) {
+            const __m128 a0 = _mm_mul_ps(_mm_load_ps(s.a_[a][0] + l), w0);
+            const __m128 a1 = _mm_mul_ps(_mm_load_ps(s.a_[a][1] + l), w1);
+            const __m128 a2 = _mm_mul_ps(_mm_load_ps(s.a_[a][2] + l), w2);
+            _mm_store_ps(s.v_ [e_attr_custom + a] + l, blerp_x4(v,  a0, a1, a2));
+            _mm_store_ps(s.sx_[e_attr_custom + a] + l, blerp_x4(sx, a0, a1, a2));
+            _mm_store_ps(s.sy_[e_attr_custom + a] + l, blerp_x4(sy, a0, a1, a2));
+        }
+    }
+    return mask;
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ----
+// avx2 setup, 8 triangles at a time
+
+N3D_TARGET_AVX2
+inline __m256 orient2d_x8(__m256 ax, __m256 ay, __m256 bx, __m256 by)
+{
+    const __m256 sign = _mm256_set1_ps(-0.f);
+    return _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(bx, ax), _mm256_xor_ps(ay, sign)),
+                         _mm256_mul_ps(_mm256_sub_ps(by, ay), _mm256_xor_ps(ax, sign)));
+}
+
+// barycentric interpolate a per vertex value
+N3D_TARGET_AVX2
+inline __m256 blerp_x8(const __m256 b[3], __m256 a0, __m256 a1, __m256 a2)
+{
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(b[0], a0), _mm256_mul_ps(b[1], a1)),
+                         _mm256_mul_ps(b[2], a2));
+}
+
+N3D_TARGET_AVX2
+uint32_t setup_x8(setup_t& s)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.f);
+
+    const __m256 x0 = _mm256_load_ps(s.x_[0]);
+    const __m256 x1 = _mm256_load_ps(s.x_[1]);
+    const __m256 x2 = _mm256_load_ps(s.x_[2]);
+    const __m256 y0 = _mm256_load_ps(s.y_[0]);
+    const __m256 y1 = _mm256_load_ps(s.y_[1]);
+    const __m256 y2 = _mm256_load_ps(s.y_[2]);
+
+    // the signed triangle area
+    const __m256 area = _mm256_sub_ps(
+        _mm256_mul_ps(_mm256_sub_ps(x1, x0), _mm256_sub_ps(y2, y0)),
+        _mm256_mul_ps(_mm256_sub_ps(x2, x0), _mm256_sub_ps(y1, y0)));
+
+    // find triangle bounds
+    const __m256 min_x = _mm256_min_ps(x0, _mm256_min_ps(x1, x2));
+    const __m256 min_y = _mm256_min_ps(y0, _mm256_min_ps(y1, y2));
+    const __m256 max_x = _mm256_max_ps(x0, _mm256_max_ps(x1, x2));
+    const __m256 max_y = _mm256_max_ps(y0, _mm256_max_ps(y1, y2));
+    _mm256_store_ps(s.min_x_, min_x);
+    _mm256_store_ps(s.min_y_, min_y);
+    _mm256_store_ps(s.max_x_, _mm256_add_ps(max_x, one));
+    _mm256_store_ps(s.max_y_, _mm256_add_ps(max_y, one));
+
+    // check for back faces and triangles with no pixel centre inside their
+    // bounds, which is when the floor of the max is less than the min.
+    s.front_ = uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(area, zero, _CMP_GT_OQ)));
+    const __m256 cx = _mm256_cmp_ps(_mm256_floor_ps(max_x), min_x, _CMP_GE_OQ);
+    const __m256 cy = _mm256_cmp_ps(_mm256_floor_ps(max_y), min_y, _CMP_GE_OQ);
+    s.cover_ = uint32_t(_mm256_movemask_ps(_mm256_and_ps(cx, cy)));
+    // skip the rest of the setup if nothing survived
+    const uint32_t mask = s.front_ & s.cover_;
+    if (!mask)
+        return 0;
+
+    // reciprocal of area for normalization
+    const __m256 ra = _mm256_div_ps(one, area);
+
+    // find normalized barycentric coordinates
+    const __m256 v[3] = {
+        _mm256_mul_ps(orient2d_x8(x1, y1, x2, y2), ra),
+        _mm256_mul_ps(orient2d_x8(x2, y2, x0, y0), ra),
+        _mm256_mul_ps(orient2d_x8(x0, y0, x1, y1), ra),
+    };
+    const __m256 sx[3] = {
+        _mm256_mul_ps(_mm256_sub_ps(y1, y2), ra),
+        _mm256_mul_ps(_mm256_sub_ps(y2, y0), ra),
+        _mm256_mul_ps(_mm256_sub_ps(y0, y1), ra),
+    };
+    const __m256 sy[3] = {
+        _mm256_mul_ps(_mm256_sub_ps(x2, x1), ra),
+        _mm256_mul_ps(_mm256_sub_ps(x0, x2), ra),
+        _mm256_mul_ps(_mm256_sub_ps(x1, x0), ra),
+    };
+    for (uint32_t i = 0; i < 3; ++i) {
+        _mm256_store_ps(s.v_ [e_attr_b0 + i], v[i]);
+        _mm256_store_ps(s.sx_[e_attr_b0 + i], sx[i]);
+        _mm256_store_ps(s.sy_[e_attr_b0 + i], sy[i]);
+    }
+
+    // calculate 1 / w for vertices
+    const __m256 w0 = _mm256_div_ps(one, _mm256_load_ps(s.w_[0]));
+    const __m256 w1 = _mm256_div_ps(one, _mm256_load_ps(s.w_[1]));
+    const __m256 w2 = _mm256_div_ps(one, _mm256_load_ps(s.w_[2]));
+
+    // interpolate 1 / w
+    _mm256_store_ps(s.v_ [e_attr_w], blerp_x8(v,  w0, w1, w2));
+    _mm256_store_ps(s.sx_[e_attr_w], blerp_x8(sx, w0, w1, w2));
+    _mm256_store_ps(s.sy_[e_attr_w], blerp_x8(sy, w0, w1, w2));
+
+    // interpolate attribute / w
+    for (uint32_t a = s.attr_first_; a < s.attr_last_; ++a) {
+        const __m256 a0 = _mm256_mul_ps(_mm256_load_ps(s.a_[a][0]), w0);
+        const __m256 a1 = _mm256_mul_ps(_mm256_load_ps(s.a_[a][1]), w1);
+        const __m256 a2 = _mm256_mul_ps(_mm256_load_ps(s.a_[a][2]), w2);
+        _mm256_store_ps(s.v_ [e_attr_custom + a], blerp_x8(v,  a0, a1, a2));
+        _mm256_store_ps(s.sx_[e_attr_custom + a], blerp_x8(sx, a0, a1, a2));
+        _mm256_store_ps(s.sy_[e_attr_custom + a], blerp_x8(sy, a0, a1, a2));
+    }
+    return mask;
+}
+
+typedef uint32_t (*setup_func_t)(setup_t&);
+
+setup_func_t select_setup()
+{
+    return (n3d_cpu_features() & n3d_cpu_avx2) ? setup_x8 : setup_x4;
+}
+
 } // namespace
 
 bool n3d_prepare(
@@ -83,3 +401,33 @@ bool n3d_prepare(
 #undef BLERPA
     return true;
 }
+
+uint32_t n3d_prepare_batch(
+    n3d_rasterizer_t::triangle_t* out,
+    const n3d_vertex_array_t& stage,
+    const uint32_t* local,
+    const uint32_t num_tris,
+    const uint32_t flags,
+    n3d_stats_t& stats)
+{
+    static const setup_func_t setup = select_setup();
+
+    // custom attributes are laid out as uv followed by rgb
+    setup_t s;
+    s.attr_first_ = (flags & e_prepare_uv) ? 0 : 2;
+    s.attr_last_ = (flags & e_prepare_rgb) ? 5 : 2;
+
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < num_tris; i += c_setup_lanes) {
+        const uint32_t count = min2(num_tris - i, c_setup_lanes);
+        setup_gather(s, stage, local + i * 3, count);
+        // drop back faces, uncovered triangles and unused lanes
+        const uint32_t used = (1u << count) - 1;
+        const uint32_t mask = setup(s) & used;
+        written += setup_scatter(s, mask, out + written);
+        // count the triangles culled for each reason
+        stats.culled_backface_ += popcount(~s.front_ & used);
+        stats.culled_coverage_ += popcount(s.front_ & ~s.cover_ & used);
+    }
+    return written;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../nano3d.h"
+#include "n3d_vertex_array.h"
 
 enum {
     e_prepare_depth = 0x01,
@@ -18,3 +19,17 @@ bool n3d_prepare(
     const n3d_vertex_t& v1,
     const n3d_vertex_t& v2,
     const uint32_t flags);
+
+// set up a batch of triangles directly from the SoA staging area, several at
+// a time.  local holds three staging slots for each triangle.  back facing
+// triangles and those which cover no pixel centre are culled and counted in
+// stats.  triangles which survive setup are written contiguously to out and
+// the number written is returned.
+
+uint32_t n3d_prepare_batch(
+    n3d_rasterizer_t::triangle_t* out,
+    const n3d_vertex_array_t& stage,
+    const uint32_t* local,
+    const uint32_t num_tris,
+    const uint32_t flags,
+    n3d_stats_t& stats);
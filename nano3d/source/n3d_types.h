@@ -3,6 +3,7 @@
 //   internal data types
 
 #include "n3d_util.h"
+#include <cstddef>
 #include <stdint.h>
 
 // vector type
@@ -96,3 +97,49 @@ protected:
     bool valid_;
     type_t type_;
 };
+
+// aligned allocator
+//   allows std containers to be used for simd processing
+template <typename type_t, size_t align_>
+struct n3d_aligned_allocator_t {
+
+    typedef type_t value_type;
+
+    template <typename other_t>
+    struct rebind {
+        typedef n3d_aligned_allocator_t<other_t, align_> other;
+    };
+
+    n3d_aligned_allocator_t()
+    {
+    }
+
+    template <typename other_t>
+    n3d_aligned_allocator_t(const n3d_aligned_allocator_t<other_t, align_>&)
+    {
+    }
+
+    type_t* allocate(size_t num)
+    {
+        void* ptr = _mm_malloc(num * sizeof(type_t), align_);
+        n3d_assert(ptr);
+        return static_cast<type_t*>(ptr);
+    }
+
+    void deallocate(type_t* ptr, size_t)
+    {
+        _mm_free(ptr);
+    }
+
+    template <typename other_t>
+    bool operator==(const n3d_aligned_allocator_t<other_t, align_>&) const
+    {
+        return true;
+    }
+
+    template <typename other_t>
+    bool operator!=(const n3d_aligned_allocator_t<other_t, align_>&) const
+    {
+        return false;
+    }
+};
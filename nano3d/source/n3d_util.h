@@ -33,6 +33,10 @@
 #endif
 #endif
 
+// data written by different threads is kept this far apart so that they do
+// not contend for the same cache line
+static const uint32_t c_cache_line = 64;
+
 template <typename type_t>
 static inline type_t* checked(type_t* x)
 {
@@ -74,3 +78,13 @@ inline constexpr type_t clamp(type_t lo, type_t in, type_t hi)
 {
     return (in < lo) ? lo : ((in > hi) ? hi : in);
 }
+
+// count the number of set bits
+static inline uint32_t popcount(uint32_t x)
+{
+#if defined(_MSC_VER)
+    return __popcnt(x);
+#else
+    return uint32_t(__builtin_popcount(x));
+#endif
+}
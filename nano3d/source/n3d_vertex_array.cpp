@@ -0,0 +1,331 @@
+// n3d_vertex_array.cpp
+//   implement the vertex pipeline kernels
+
+#include <immintrin.h>
+
+#include "n3d_cpu.h"
+#include "n3d_vertex_array.h"
+
+namespace {
+
+// round up to a whole number of kernel iterations
+constexpr uint32_t pad(const uint32_t count)
+{
+    return (count + c_vertex_lanes - 1) & ~(c_vertex_lanes - 1);
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ----
+// scalar kernels
+
+void transform_x1(n3d_vertex_array_t& a, const n3d_vertex_array_t& s,
+                  const uint32_t count, const mat4f_t& m)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        // load data
+        const float x = s.x_[i], y = s.y_[i], z = s.z_[i], w = s.w_[i];
+        // transform vertices
+        const float tx = x * m(0, 0) + y * m(1, 0) + z * m(2, 0) + w * m(3, 0);
+        const float ty = x * m(0, 1) + y * m(1, 1) + z * m(2, 1) + w * m(3, 1);
+        const float tz = x * m(0, 2) + y * m(1, 2) + z * m(2, 2) + w * m(3, 2);
+        const float tw = x * m(0, 3) + y * m(1, 3) + z * m(2, 3) + w * m(3, 3);
+        // save data
+        (a.x_[i] = tx), (a.y_[i] = ty), (a.z_[i] = tz), (a.w_[i] = tw);
+    }
+}
+
+void clip_codes_x1(n3d_vertex_array_t& a, const uint32_t count, const float guard)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        const float x = a.x_[i], y = a.y_[i], z = a.z_[i], w = a.w_[i];
+        const float g = w * guard;
+        a.code_[i] = ((x < -w) ? e_clip_left    : 0) | ((x > w) ? e_clip_right : 0) |
+                     ((y < -w) ? e_clip_bottom  : 0) | ((y > w) ? e_clip_top   : 0) |
+                     ((z < -w) ? e_clip_near    : 0) | ((z > w) ? e_clip_far   : 0) |
+                     ((x < -g) ? e_guard_left   : 0) | ((x > g) ? e_guard_right : 0) |
+                     ((y < -g) ? e_guard_bottom : 0) | ((y > g) ? e_guard_top  : 0);
+    }
+}
+
+void w_divide_x1(n3d_vertex_array_t& a, const uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        const float iw = 1.f / a.w_[i];
+        a.x_[i] *= iw;
+        a.y_[i] *= iw;
+        a.z_[i] *= iw;
+    }
+}
+
+void ndc_transform_x1(n3d_vertex_array_t& a, const uint32_t count, const vec2f_t& sf)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        a.x_[i] = (a.x_[i] + 1.f) * sf.x;
+        a.y_[i] = (a.y_[i] + 1.f) * sf.y;
+    }
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ----
+// sse kernels, 4 vertices at a time
+
+void transform_x4(n3d_vertex_array_t& a, const n3d_vertex_array_t& s,
+                  const uint32_t count, const mat4f_t& m)
+{
+    // broadcast the matrix
+    __m128 k[16];
+    for (uint32_t i = 0; i < 16; ++i) {
+        k[i] = _mm_set1_ps(m(i));
+    }
+    const float *sx = s.x_.data(), *sy = s.y_.data();
+    const float *sz = s.z_.data(), *sw = s.w_.data();
+    float *px = a.x_.data(), *py = a.y_.data();
+    float *pz = a.z_.data(), *pw = a.w_.data();
+    for (uint32_t i = 0; i < pad(count); i += 4) {
+        // load data
+        const __m128 x = _mm_load_ps(sx + i), y = _mm_load_ps(sy + i);
+        const __m128 z = _mm_load_ps(sz + i), w = _mm_load_ps(sw + i);
+        // transform vertices
+        for (uint32_t j = 0; j < 4; ++j) {
+            __m128 t = _mm_mul_ps(x, k[j * 4 + 0]);
+            t = _mm_add_ps(t, _mm_mul_ps(y, k[j * 4 + 1]));
+            t = _mm_add_ps(t, _mm_mul_ps(z, k[j * 4 + 2]));
+            t = _mm_add_ps(t, _mm_mul_ps(w, k[j * 4 + 3]));
+            // save data
+            float* out[4] = { px, py, pz, pw };
+            _mm_store_ps(out[j] + i, t);
+        }
+    }
+}
+
+// select a clip code bit for each lane where mask is set
+inline __m128 code_x4(__m128 mask, uint32_t code)
+{
+    return _mm_and_ps(mask, _mm_castsi128_ps(_mm_set1_epi32(int32_t(code))));
+}
+
+void clip_codes_x4(n3d_vertex_array_t& a, const uint32_t count, const float guard)
+{
+    const __m128 sign = _mm_set1_ps(-0.f);
+    const __m128 gb = _mm_set1_ps(guard);
+    const float *px = a.x_.data(), *py = a.y_.data();
+    const float *pz = a.z_.data(), *pw = a.w_.data();
+    uint32_t* pc = a.code_.data();
+    for (uint32_t i = 0; i < pad(count); i += 4) {
+        const __m128 x = _mm_load_ps(px + i), y = _mm_load_ps(py + i);
+        const __m128 z = _mm_load_ps(pz + i), w = _mm_load_ps(pw + i);
+        const __m128 nw = _mm_xor_ps(w, sign);
+        const __m128 g = _mm_mul_ps(w, gb), ng = _mm_xor_ps(g, sign);
+        __m128 c = code_x4(_mm_cmplt_ps(x, nw), e_clip_left);
+        c = _mm_or_ps(c, code_x4(_mm_cmpgt_ps(x, w), e_clip_right));
+        c = _mm_or_ps(c, code_x4(_mm_cmplt_ps(y, nw), e_clip_bottom));
+        c = _mm_or_ps(c, code_x4(_mm_cmpgt_ps(y, w), e_clip_top));
+        c = _mm_or_ps(c, code_x4(_mm_cmplt_ps(z, nw), e_clip_near));
+        c = _mm_or_ps(c, code_x4(_mm_cmpgt_ps(z, w), e_clip_far));
+        c = _mm_or_ps(c, code_x4(_mm_cmplt_ps(x, ng), e_guard_left));
+        c = _mm_or_ps(c, code_x4(_mm_cmpgt_ps(x, g), e_guard_right));
+        c = _mm_or_ps(c, code_x4(_mm_cmplt_ps(y, ng), e_guard_bottom));
+        c = _mm_or_ps(c, code_x4(_mm_cmpgt_ps(y, g), e_guard_top));
+        _mm_store_si128(reinterpret_cast<__m128i*>(pc + i), _mm_castps_si128(c));
+    }
+}
+
+void w_divide_x4(n3d_vertex_array_t& a, const uint32_t count)
+{
+    const __m128 two = _mm_set1_ps(2.f);
+    float *px = a.x_.data(), *py = a.y_.data();
+    float *pz = a.z_.data(), *pw = a.w_.data();
+    for (uint32_t i = 0; i < pad(count); i += 4) {
+        const __m128 w = _mm_load_ps(pw + i);
+        // reciprocal estimate refined with one newton-raphson step
+        __m128 iw = _mm_rcp_ps(w);
+        iw = _mm_mul_ps(iw, _mm_sub_ps(two, _mm_mul_ps(w, iw)));
+        _mm_store_ps(px + i, _mm_mul_ps(_mm_load_ps(px + i), iw));
+        _mm_store_ps(py + i, _mm_mul_ps(_mm_load_ps(py + i), iw));
+        _mm_store_ps(pz + i, _mm_mul_ps(_mm_load_ps(pz + i), iw));
+    }
+}
+
+void ndc_transform_x4(n3d_vertex_array_t& a, const uint32_t count, const vec2f_t& sf)
+{
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 sx = _mm_set1_ps(sf.x), sy = _mm_set1_ps(sf.y);
+    float *px = a.x_.data(), *py = a.y_.data();
+    for (uint32_t i = 0; i < pad(count); i += 4) {
+        _mm_store_ps(px + i, _mm_mul_ps(_mm_add_ps(_mm_load_ps(px + i), one), sx));
+        _mm_store_ps(py + i, _mm_mul_ps(_mm_add_ps(_mm_load_ps(py + i), one), sy));
+    }
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ----
+// avx2 kernels, 8 vertices at a time
+
+N3D_TARGET_AVX2
+void transform_x8(n3d_vertex_array_t& a, const n3d_vertex_array_t& s,
+                  const uint32_t count, const mat4f_t& m)
+{
+    // broadcast the matrix
+    __m256 k[16];
+    for (uint32_t i = 0; i < 16; ++i) {
+        k[i] = _mm256_set1_ps(m(i));
+    }
+    const float *sx = s.x_.data(), *sy = s.y_.data();
+    const float *sz = s.z_.data(), *sw = s.w_.data();
+    float *px = a.x_.data(), *py = a.y_.data();
+    float *pz = a.z_.data(), *pw = a.w_.data();
+    for (uint32_t i = 0; i < pad(count); i += 8) {
+        // load data
+        const __m256 x = _mm256_load_ps(sx + i), y = _mm256_load_ps(sy + i);
+        const __m256 z = _mm256_load_ps(sz + i), w = _mm256_load_ps(sw + i);
+        // transform vertices
+        for (uint32_t j = 0; j < 4; ++j) {
+            __m256 t = _mm256_mul_ps(x, k[j * 4 + 0]);
+            t = _mm256_add_ps(t, _mm256_mul_ps(y, k[j * 4 + 1]));
+            t = _mm256_add_ps(t, _mm256_mul_ps(z, k[j * 4 + 2]));
+            t = _mm256_add_ps(t, _mm256_mul_ps(w, k[j * 4 + 3]));
+            // save data
+            float* out[4] = { px, py, pz, pw };
+            _mm256_store_ps(out[j] + i, t);
+        }
+    }
+}
+
+// select a clip code bit for each lane where mask is set
+N3D_TARGET_AVX2
+inline __m256 code_x8(__m256 mask, uint32_t code)
+{
+    return _mm256_and_ps(mask, _mm256_castsi256_ps(_mm256_set1_epi32(int32_t(code))));
+}
+
+N3D_TARGET_AVX2
+void clip_codes_x8(n3d_vertex_array_t& a, const uint32_t count, const float guard)
+{
+    const __m256 sign = _mm256_set1_ps(-0.f);
+    const __m256 gb = _mm256_set1_ps(guard);
+    const float *px = a.x_.data(), *py = a.y_.data();
+    const float *pz = a.z_.data(), *pw = a.w_.data();
+    uint32_t* pc = a.code_.data();
+    for (uint32_t i = 0; i < pad(count); i += 8) {
+        const __m256 x = _mm256_load_ps(px + i), y = _mm256_load_ps(py + i);
+        const __m256 z = _mm256_load_ps(pz + i), w = _mm256_load_ps(pw + i);
+        const __m256 nw = _mm256_xor_ps(w, sign);
+        const __m256 g = _mm256_mul_ps(w, gb), ng = _mm256_xor_ps(g, sign);
+        __m256 c = code_x8(_mm256_cmp_ps(x, nw, _CMP_LT_OQ), e_clip_left);
+        c = _mm256_or_ps(c, code_x8(_mm256_cmp_ps(x, w, _CMP_GT_OQ), e_clip_right));
+        c = _mm256_or_ps(c, code_x8(_mm256_cmp_ps(y, nw, _CMP_LT_OQ), e_clip_bottom));
+        c = _mm256_or_ps(c, code_x8(_mm256_cmp_ps(y, w, _CMP_GT_OQ), e_clip_top));
+        c = _mm256_or_ps(c, code_x8(_mm256_cmp_ps(z, nw, _CMP_LT_OQ), e_clip_near));
+        c = _mm256_or_ps(c, code_x8(_mm256_cmp_ps(z, w, _CMP_GT_OQ), e_clip_far));
+        c = _mm256_or_ps(c, code_x8(_mm256_cmp_ps(x, ng, _CMP_LT_OQ), e_guard_left));
+        c = _mm256_or_ps(c, code_x8(_mm256_cmp_ps(x, g, _CMP_GT_OQ), e_guard_right));
+        c = _mm256_or_ps(c, code_x8(_mm256_cmp_ps(y, ng, _CMP_LT_OQ), e_guard_bottom));
+        c = _mm256_or_ps(c, code_x8(_mm256_cmp_ps(y, g, _CMP_GT_OQ), e_guard_top));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(pc + i), _mm256_castps_si256(c));
+    }
+}
+
+N3D_TARGET_AVX2
+void w_divide_x8(n3d_vertex_array_t& a, const uint32_t count)
+{
+    const __m256 two = _mm256_set1_ps(2.f);
+    float *px = a.x_.data(), *py = a.y_.data();
+    float *pz = a.z_.data(), *pw = a.w_.data();
+    for (uint32_t i = 0; i < pad(count); i += 8) {
+        const __m256 w = _mm256_load_ps(pw + i);
+        // reciprocal estimate refined with one newton-raphson step
+        __m256 iw = _mm256_rcp_ps(w);
+        iw = _mm256_mul_ps(iw, _mm256_sub_ps(two, _mm256_mul_ps(w, iw)));
+        _mm256_store_ps(px + i, _mm256_mul_ps(_mm256_load_ps(px + i), iw));
+        _mm256_store_ps(py + i, _mm256_mul_ps(_mm256_load_ps(py + i), iw));
+        _mm256_store_ps(pz + i, _mm256_mul_ps(_mm256_load_ps(pz + i), iw));
+    }
+}
+
+N3D_TARGET_AVX2
+void ndc_transform_x8(n3d_vertex_array_t& a, const uint32_t count, const vec2f_t& sf)
+{
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 sx = _mm256_set1_ps(sf.x), sy = _mm256_set1_ps(sf.y);
+    float *px = a.x_.data(), *py = a.y_.data();
+    for (uint32_t i = 0; i < pad(count); i += 8) {
+        _mm256_store_ps(px + i, _mm256_mul_ps(_mm256_add_ps(_mm256_load_ps(px + i), one), sx));
+        _mm256_store_ps(py + i, _mm256_mul_ps(_mm256_add_ps(_mm256_load_ps(py + i), one), sy));
+    }
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ----
+// kernel dispatch
+
+struct kernels_t {
+    void (*transform_)(n3d_vertex_array_t&, const n3d_vertex_array_t&,
+                       const uint32_t, const mat4f_t&);
+    void (*clip_codes_)(n3d_vertex_array_t&, const uint32_t, const float);
+    void (*w_divide_)(n3d_vertex_array_t&, const uint32_t);
+    void (*ndc_transform_)(n3d_vertex_array_t&, const uint32_t, const vec2f_t&);
+};
+
+kernels_t select_kernels()
+{
+    const uint32_t features = n3d_cpu_features();
+    if (features & n3d_cpu_avx2) {
+        return kernels_t{ transform_x8, clip_codes_x8, w_divide_x8, ndc_transform_x8 };
+    }
+    if (features & n3d_cpu_sse2) {
+        return kernels_t{ transform_x4, clip_codes_x4, w_divide_x4, ndc_transform_x4 };
+    }
+    return kernels_t{ transform_x1, clip_codes_x1, w_divide_x1, ndc_transform_x1 };
+}
+
+const kernels_t& kernels()
+{
+    static const kernels_t k = select_kernels();
+    return k;
+}
+
+} // namespace {}
+
+void n3d_vertex_array_t::resize(const uint32_t count)
+{
+    // pad so that the simd kernels can run over the end
+    const uint32_t size = pad(count);
+    x_.resize(size);
+    y_.resize(size);
+    z_.resize(size);
+    w_.resize(size);
+    u_.resize(size);
+    v_.resize(size);
+    r_.resize(size);
+    g_.resize(size);
+    b_.resize(size);
+    code_.resize(size);
+}
+
+void n3d_vertex_array_t::transform(const uint32_t count, const mat4f_t& m)
+{
+    n3d_assert(pad(count) <= x_.size());
+    kernels().transform_(*this, *this, count, m);
+}
+
+void n3d_vertex_array_t::transform(const uint32_t count, const mat4f_t& m,
+                                   const n3d_vertex_array_t& src)
+{
+    n3d_assert(pad(count) <= x_.size());
+    n3d_assert(pad(count) <= src.x_.size());
+    kernels().transform_(*this, src, count, m);
+}
+
+void n3d_vertex_array_t::clip_codes(const uint32_t count, const float guard)
+{
+    n3d_assert(pad(count) <= code_.size());
+    kernels().clip_codes_(*this, count, guard);
+}
+
+void n3d_vertex_array_t::w_divide(const uint32_t count)
+{
+    n3d_assert(pad(count) <= x_.size());
+    kernels().w_divide_(*this, count);
+}
+
+void n3d_vertex_array_t::ndc_transform(const uint32_t count, const vec2f_t& sf)
+{
+    n3d_assert(pad(count) <= x_.size());
+    kernels().ndc_transform_(*this, count, sf);
+}
@@ -0,0 +1,79 @@
+#pragma once
+// n3d_vertex_array.h
+//   SoA staging area for the vertex pipeline
+
+#include <vector>
+
+#include "n3d_decl.h"
+#include "n3d_types.h"
+
+// the n3d_vertex_array_t is used as a staging area for vertices traveling
+// through the pipeline towards the rasterizers.  vertex attributes are stored
+// in SoA form so that each stage can process many vertices at once.  the
+// stages are implemented by scalar, sse and avx2 kernels and the widest one
+// supported by the host is selected at runtime.
+
+// number of vertices processed at once by the widest kernel.  the staging
+// arrays are padded to a multiple of this so kernels never need a scalar tail.
+static const uint32_t c_vertex_lanes = 8;
+
+// clip codes
+//   bit flags marking which clip planes a vertex lies outside of
+enum n3d_clip_code_e {
+    // view frustum planes
+    e_clip_left     = 0x001,
+    e_clip_right    = 0x002,
+    e_clip_bottom   = 0x004,
+    e_clip_top      = 0x008,
+    e_clip_near     = 0x010,
+    e_clip_far      = 0x020,
+    e_clip_frustum  = 0x03f,
+    // guard band planes
+    e_guard_left    = 0x040,
+    e_guard_right   = 0x080,
+    e_guard_bottom  = 0x100,
+    e_guard_top     = 0x200,
+    e_guard_band    = 0x3c0,
+};
+
+struct n3d_vertex_array_t {
+
+    typedef std::vector<float, n3d_aligned_allocator_t<float, 32>> array_t;
+    typedef std::vector<uint32_t, n3d_aligned_allocator_t<uint32_t, 32>> code_array_t;
+
+    // resize the staging area to hold a number of vertices
+    void resize(const uint32_t count);
+
+    // matrix transformation
+    void transform(const uint32_t count, const mat4f_t& m);
+
+    // matrix transformation of the positions in src, leaving the other
+    // attributes untouched
+    void transform(const uint32_t count, const mat4f_t& m,
+                   const n3d_vertex_array_t& src);
+
+    // find the clip codes for vertices in homogeneous clip space.  guard is
+    // the size of the guard band relative to the view frustum.
+    void clip_codes(const uint32_t count, const float guard);
+
+    // perspecive division
+    void w_divide(const uint32_t count);
+
+    // transform into normalized device coordinates
+    void ndc_transform(const uint32_t count, const vec2f_t& sf);
+
+    // pos
+    array_t x_;
+    array_t y_;
+    array_t z_;
+    array_t w_;
+    // tex coords
+    array_t u_;
+    array_t v_;
+    // colour
+    array_t r_;
+    array_t g_;
+    array_t b_;
+    // clip codes
+    code_array_t code_;
+};
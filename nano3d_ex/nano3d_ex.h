@@ -8,6 +8,7 @@ enum n3d_rasterizer_e {
     n3d_raster_depth,
     n3d_raster_texture,
     n3d_raster_depth_sse,
+    n3d_raster_texture_sse,
 };
 
 n3d_rasterizer_t* n3d_rasterizer_new(n3d_rasterizer_e);
@@ -24,4 +24,15 @@ inline aabb_t get_bound(
     };
 }
 
+// log2 of a power of two, used to turn a texture row into a shift
+inline uint32_t texture_shift(uint32_t size)
+{
+    n3d_assert(size && (size & (size - 1)) == 0);
+    uint32_t shift = 0;
+    while ((1u << shift) < size) {
+        ++shift;
+    }
+    return shift;
+}
+
 } // namespace {}
@@ -0,0 +1,451 @@
+#pragma once
+#include <cstdint>
+#include <immintrin.h>
+
+#include "nano3d.h"
+#include "source/n3d_cpu.h"
+#include "source/n3d_util.h"
+
+#include "n3d_ex_common.h"
+
+// the generic parts of a kernel are forced inline so that they are built for
+// the target of the kernel entry point which calls them
+#if defined(_MSC_VER)
+#define N3D_EX_INLINE __forceinline
+#else
+#define N3D_EX_INLINE inline __attribute__((always_inline))
+#endif
+
+// bracket code which passes lane vectors around generically
+// note: gcc warns that 256 bit vectors passed by value there change the abi
+//       without avx, but that code is only ever inlined into avx2 entry
+//       points so no such call is made.
+#if defined(__GNUC__)
+#define N3D_EX_LANES_BEGIN                              \
+    _Pragma("GCC diagnostic push")                      \
+    _Pragma("GCC diagnostic ignored \"-Wpsabi\"")
+#define N3D_EX_LANES_END                                \
+    _Pragma("GCC diagnostic pop")
+#else
+#define N3D_EX_LANES_BEGIN
+#define N3D_EX_LANES_END
+#endif
+
+namespace {
+
+// lane operations for the vector rasterizers
+//      the kernels are written once against these and built at 4 and 8
+//      lanes, with the 8 lane entry points chosen at runtime when the cpu
+//      has avx2.  lanes past the edge of a bin belong to the bin next to it,
+//      so partial loads and stores never touch them.
+
+// 4 lanes using only sse2
+struct simd4_t {
+
+    static const uint32_t c_width = 4;
+
+    typedef __m128  vf_t;
+    typedef __m128i vi_t;
+
+    static vf_t splat(float v)
+    {
+        return _mm_set1_ps(v);
+    }
+
+    static vi_t splat(uint32_t v)
+    {
+        return _mm_set1_epi32(int32_t(v));
+    }
+
+    // lane index as a float
+    static vf_t ramp()
+    {
+        return _mm_setr_ps(0.f, 1.f, 2.f, 3.f);
+    }
+
+    static vf_t add(vf_t a, vf_t b)
+    {
+        return _mm_add_ps(a, b);
+    }
+
+    static vf_t mul(vf_t a, vf_t b)
+    {
+        return _mm_mul_ps(a, b);
+    }
+
+    static vf_t div(vf_t a, vf_t b)
+    {
+        return _mm_div_ps(a, b);
+    }
+
+    static vf_t minimum(vf_t a, vf_t b)
+    {
+        return _mm_min_ps(a, b);
+    }
+
+    static vf_t maximum(vf_t a, vf_t b)
+    {
+        return _mm_max_ps(a, b);
+    }
+
+    static vf_t bit_and(vf_t a, vf_t b)
+    {
+        return _mm_and_ps(a, b);
+    }
+
+    static vi_t bit_and(vi_t a, vi_t b)
+    {
+        return _mm_and_si128(a, b);
+    }
+
+    static vi_t bit_or(vi_t a, vi_t b)
+    {
+        return _mm_or_si128(a, b);
+    }
+
+    static vi_t shift_left(vi_t a, uint32_t n)
+    {
+        return _mm_sll_epi32(a, _mm_cvtsi32_si128(int32_t(n)));
+    }
+
+    // lane mask of a > b
+    static vf_t greater(vf_t a, vf_t b)
+    {
+        return _mm_cmpgt_ps(a, b);
+    }
+
+    // lane mask of a >= b
+    static vf_t greater_equal(vf_t a, vf_t b)
+    {
+        return _mm_cmpge_ps(a, b);
+    }
+
+    // one bit per set lane, limited to the first n lanes
+    static uint32_t bits(vf_t mask, uint32_t n)
+    {
+        return uint32_t(_mm_movemask_ps(mask)) & ((1u << n) - 1);
+    }
+
+    // truncate towards zero
+    static vi_t to_int(vf_t a)
+    {
+        return _mm_cvttps_epi32(a);
+    }
+
+    // fetch base[index] for each lane
+    static vi_t gather(const uint32_t* base, vi_t index)
+    {
+        alignas(16) uint32_t i[c_width];
+        _mm_store_si128(reinterpret_cast<__m128i*>(i), index);
+        return _mm_setr_epi32(
+            int32_t(base[i[0]]), int32_t(base[i[1]]),
+            int32_t(base[i[2]]), int32_t(base[i[3]]));
+    }
+
+    // load the first n lanes
+    static vf_t load(const float* p, uint32_t n)
+    {
+        if (n == c_width) {
+            return _mm_loadu_ps(p);
+        }
+        alignas(16) float v[c_width] = { 0.f, 0.f, 0.f, 0.f };
+        for (uint32_t i = 0; i < n; ++i) {
+            v[i] = p[i];
+        }
+        return _mm_load_ps(v);
+    }
+
+    // store the lanes set in mask within the first n lanes
+    static void store(float* p, vf_t v, vf_t mask, uint32_t n)
+    {
+        if (n == c_width) {
+            // every lane is ours so blend with what is there
+            const __m128 old = _mm_loadu_ps(p);
+            _mm_storeu_ps(p, _mm_or_ps(_mm_and_ps(mask, v), _mm_andnot_ps(mask, old)));
+            return;
+        }
+        alignas(16) float t[c_width];
+        _mm_store_ps(t, v);
+        const uint32_t set = bits(mask, n);
+        for (uint32_t i = 0; i < n; ++i) {
+            if (set & (1u << i)) {
+                p[i] = t[i];
+            }
+        }
+    }
+
+    static void store(uint32_t* p, vi_t v, vf_t mask, uint32_t n)
+    {
+        if (n == c_width) {
+            const __m128i m = _mm_castps_si128(mask);
+            const __m128i old = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p),
+                _mm_or_si128(_mm_and_si128(m, v), _mm_andnot_si128(m, old)));
+            return;
+        }
+        alignas(16) uint32_t t[c_width];
+        _mm_store_si128(reinterpret_cast<__m128i*>(t), v);
+        const uint32_t set = bits(mask, n);
+        for (uint32_t i = 0; i < n; ++i) {
+            if (set & (1u << i)) {
+                p[i] = t[i];
+            }
+        }
+    }
+};
+
+N3D_EX_LANES_BEGIN
+
+// 8 lanes using avx2.  these must only be reached from N3D_TARGET_AVX2 entry
+// points.
+struct simd8_t {
+
+    static const uint32_t c_width = 8;
+
+    typedef __m256  vf_t;
+    typedef __m256i vi_t;
+
+    N3D_TARGET_AVX2
+    static vf_t splat(float v)
+    {
+        return _mm256_set1_ps(v);
+    }
+
+    N3D_TARGET_AVX2
+    static vi_t splat(uint32_t v)
+    {
+        return _mm256_set1_epi32(int32_t(v));
+    }
+
+    N3D_TARGET_AVX2
+    static vf_t ramp()
+    {
+        return _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+    }
+
+    N3D_TARGET_AVX2
+    static vf_t add(vf_t a, vf_t b)
+    {
+        return _mm256_add_ps(a, b);
+    }
+
+    N3D_TARGET_AVX2
+    static vf_t mul(vf_t a, vf_t b)
+    {
+        return _mm256_mul_ps(a, b);
+    }
+
+    N3D_TARGET_AVX2
+    static vf_t div(vf_t a, vf_t b)
+    {
+        return _mm256_div_ps(a, b);
+    }
+
+    N3D_TARGET_AVX2
+    static vf_t minimum(vf_t a, vf_t b)
+    {
+        return _mm256_min_ps(a, b);
+    }
+
+    N3D_TARGET_AVX2
+    static vf_t maximum(vf_t a, vf_t b)
+    {
+        return _mm256_max_ps(a, b);
+    }
+
+    N3D_TARGET_AVX2
+    static vf_t bit_and(vf_t a, vf_t b)
+    {
+        return _mm256_and_ps(a, b);
+    }
+
+    N3D_TARGET_AVX2
+    static vi_t bit_and(vi_t a, vi_t b)
+    {
+        return _mm256_and_si256(a, b);
+    }
+
+    N3D_TARGET_AVX2
+    static vi_t bit_or(vi_t a, vi_t b)
+    {
+        return _mm256_or_si256(a, b);
+    }
+
+    N3D_TARGET_AVX2
+    static vi_t shift_left(vi_t a, uint32_t n)
+    {
+        return _mm256_sll_epi32(a, _mm_cvtsi32_si128(int32_t(n)));
+    }
+
+    N3D_TARGET_AVX2
+    static vf_t greater(vf_t a, vf_t b)
+    {
+        return _mm256_cmp_ps(a, b, _CMP_GT_OQ);
+    }
+
+    N3D_TARGET_AVX2
+    static vf_t greater_equal(vf_t a, vf_t b)
+    {
+        return _mm256_cmp_ps(a, b, _CMP_GE_OQ);
+    }
+
+    N3D_TARGET_AVX2
+    static uint32_t bits(vf_t mask, uint32_t n)
+    {
+        return uint32_t(_mm256_movemask_ps(mask)) & ((1u << n) - 1);
+    }
+
+    N3D_TARGET_AVX2
+    static vi_t to_int(vf_t a)
+    {
+        return _mm256_cvttps_epi32(a);
+    }
+
+    N3D_TARGET_AVX2
+    static vi_t gather(const uint32_t* base, vi_t index)
+    {
+        return _mm256_i32gather_epi32(reinterpret_cast<const int*>(base), index, 4);
+    }
+
+    // lane mask of the first n lanes
+    N3D_TARGET_AVX2
+    static vi_t first(uint32_t n)
+    {
+        return _mm256_cmpgt_epi32(
+            _mm256_set1_epi32(int32_t(n)),
+            _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    }
+
+    N3D_TARGET_AVX2
+    static vf_t load(const float* p, uint32_t n)
+    {
+        if (n == c_width) {
+            return _mm256_loadu_ps(p);
+        }
+        return _mm256_maskload_ps(p, first(n));
+    }
+
+    N3D_TARGET_AVX2
+    static void store(float* p, vf_t v, vf_t mask, uint32_t n)
+    {
+        const __m256i m = _mm256_and_si256(_mm256_castps_si256(mask), first(n));
+        _mm256_maskstore_ps(p, m, v);
+    }
+
+    N3D_TARGET_AVX2
+    static void store(uint32_t* p, vi_t v, vf_t mask, uint32_t n)
+    {
+        const __m256i m = _mm256_and_si256(_mm256_castps_si256(mask), first(n));
+        _mm256_maskstore_epi32(reinterpret_cast<int*>(p), m, v);
+    }
+};
+
+// rasterize a triangle over a bin a group of lanes at a time
+//      the barycentrics and 1/w decide which lanes are covered and pass the
+//      depth test, and the shader then finds their colour.  attributes are
+//      stepped in order from e_attr_b0, and shade_t provides:
+//          c_attrs             - number of attributes to step
+//          scale(attr)         - factor to apply to an attribute
+//          shade<lanes_t>(v, colour)
+//                              - colour of a group from its attributes
+template <typename lanes_t, typename shade_t>
+N3D_EX_INLINE void raster_lanes(
+    const n3d_rasterizer_t::state_t& s,
+    const n3d_rasterizer_t::triangle_t& t,
+    const shade_t& shade)
+{
+    typedef typename lanes_t::vf_t vf_t;
+    typedef typename lanes_t::vi_t vi_t;
+    static const uint32_t c_width = lanes_t::c_width;
+    static const uint32_t c_attrs = shade_t::c_attrs;
+
+    // bin / triangle intersection boundary
+    const aabb_t   bound   = get_bound(s, t);
+    const uint32_t offsetx = s.offset_.x + bound.x0;
+    const uint32_t offsety = s.offset_.y + bound.y0;
+    const uint32_t pitch   = s.pitch_;
+
+    // interpolants for the lanes of the first group, and their steps
+    vf_t v_y[c_attrs], s_x[c_attrs], s_y[c_attrs];
+    for (uint32_t i = 0; i < c_attrs; ++i) {
+        const float k  = shade.scale(i);
+        const float v  = t.v_ [i] * k;
+        const float sx = t.sx_[i] * k;
+        const float sy = t.sy_[i] * k;
+        // shift to offset and spread across the lanes
+        v_y[i] = lanes_t::add(
+            lanes_t::splat(v + sx * offsetx + sy * offsety),
+            lanes_t::mul(lanes_t::splat(sx), lanes_t::ramp()));
+        s_x[i] = lanes_t::splat(sx * c_width);
+        s_y[i] = lanes_t::splat(sy);
+    }
+
+    const vf_t zero = lanes_t::splat(0.f);
+
+    // frame buffer targets
+    uint32_t* dst = s.target_[n3d_target_pixel].uint32_;
+    float* depth = s.target_[n3d_target_depth].float_;
+
+    // pre step the buffers to y location
+    dst   += pitch * bound.y0;
+    depth += pitch * bound.y0;
+
+    const int32_t width = int32_t(s.width_);
+
+    // y axis
+    for (int32_t y = bound.y0; y < bound.y1; ++y) {
+
+        // fresh variables to step along this scanline
+        vf_t v_x[c_attrs];
+        for (uint32_t i = 0; i < c_attrs; ++i) {
+            v_x[i] = v_y[i];
+        }
+
+        // x axis
+        for (int32_t x = bound.x0; x < bound.x1; x += c_width) {
+
+            // lanes which lie inside this bin
+            const uint32_t lanes = uint32_t(min2<int32_t>(c_width, width - x));
+
+            // check if inside triangle
+            vf_t mask = lanes_t::bit_and(
+                lanes_t::greater_equal(v_x[e_attr_b0], zero),
+                lanes_t::bit_and(
+                    lanes_t::greater_equal(v_x[e_attr_b1], zero),
+                    lanes_t::greater_equal(v_x[e_attr_b2], zero)));
+
+            // depth test (w buffering)
+            mask = lanes_t::bit_and(mask,
+                lanes_t::greater(v_x[e_attr_w], lanes_t::load(depth + x, lanes)));
+
+            if (lanes_t::bits(mask, lanes)) {
+                vi_t colour;
+                shade.template shade<lanes_t>(v_x, colour);
+
+                // update colour and (w) depth buffer
+                lanes_t::store(dst + x, colour, mask, lanes);
+                lanes_t::store(depth + x, v_x[e_attr_w], mask, lanes);
+            }
+
+            // step on x axis
+            for (uint32_t i = 0; i < c_attrs; ++i) {
+                v_x[i] = lanes_t::add(v_x[i], s_x[i]);
+            }
+
+        } // for (x axis)
+
+        // step on y axis
+        for (uint32_t i = 0; i < c_attrs; ++i) {
+            v_y[i] = lanes_t::add(v_y[i], s_y[i]);
+        }
+
+        // step the buffers
+        dst   += pitch;
+        depth += pitch;
+
+    } // for (y axis)
+}
+
+N3D_EX_LANES_END
+
+} // namespace {}
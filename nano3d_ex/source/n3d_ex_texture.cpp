@@ -49,6 +49,8 @@ void n3d_raster_texture_raster(
     const uint32_t vsize = tex->height_;
     const uint32_t umask = usize - 1;
     const uint32_t vmask = vsize - 1;
+    // texture rows are usize texels apart
+    const uint32_t ushift = texture_shift(usize);
 
     // uv interpolants
           vec2f_t uv_vy = { t.v_ [e_attr_u]*usize, t.v_ [e_attr_v]*vsize }; // origin
@@ -94,12 +96,11 @@ void n3d_raster_texture_raster(
                     const float u = uv_vx.x / w_vx;
                     const float v = uv_vx.y / w_vx;
 
-                    //todo: pull multiply out of inner loop
                     const int32_t ui = int32_t(u) & umask;
                     const int32_t vi = int32_t(v) & vmask;
 
                     // update colour buffer
-                    dst[x] = texture[ui + vi*32];
+                    dst[x] = texture[(vi << ushift) | ui];
 
                     // update (w) depth buffer
                     depth[x] = w_vx;
@@ -0,0 +1,83 @@
+#include "nano3d.h"
+#include "source/n3d_cpu.h"
+#include "source/n3d_math.h"
+#include "source/n3d_util.h"
+
+#include "n3d_ex_common.h"
+#include "n3d_ex_simd.h"
+
+namespace {
+
+N3D_EX_LANES_BEGIN
+
+// perspective correct texture lookup
+struct texture_shade_t {
+
+    static const uint32_t c_attrs = e_attr_v + 1;
+
+    texture_shade_t(const n3d_texture_t* tex)
+        : texture_(tex->texels_)
+        , usize_(tex->width_)
+        , vsize_(tex->height_)
+        , ushift_(texture_shift(tex->width_))
+    {
+    }
+
+    // uv are stepped in texels
+    float scale(uint32_t attr) const
+    {
+        switch (attr) {
+        case e_attr_u: return float(usize_);
+        case e_attr_v: return float(vsize_);
+        default:       return 1.f;
+        }
+    }
+
+    template <typename lanes_t>
+    N3D_EX_INLINE void shade(
+        const typename lanes_t::vf_t* v,
+        typename lanes_t::vi_t& colour) const
+    {
+        typedef typename lanes_t::vf_t vf_t;
+        typedef typename lanes_t::vi_t vi_t;
+
+        // one reciprocal serves both texture coordinates
+        const vf_t rw = lanes_t::div(lanes_t::splat(1.f), v[e_attr_w]);
+        const vi_t ui = lanes_t::bit_and(
+            lanes_t::to_int(lanes_t::mul(v[e_attr_u], rw)), lanes_t::splat(usize_ - 1));
+        const vi_t vi = lanes_t::bit_and(
+            lanes_t::to_int(lanes_t::mul(v[e_attr_v], rw)), lanes_t::splat(vsize_ - 1));
+
+        // texture rows are usize texels apart
+        colour = lanes_t::gather(
+            texture_, lanes_t::bit_or(lanes_t::shift_left(vi, ushift_), ui));
+    }
+
+    const uint32_t* texture_;
+    const uint32_t usize_;
+    const uint32_t vsize_;
+    const uint32_t ushift_;
+};
+
+N3D_EX_LANES_END
+
+} // namespace {}
+
+void n3d_raster_texture_raster_sse(
+    const n3d_rasterizer_t::state_t& s,
+    const n3d_rasterizer_t::triangle_t& t,
+    void* user)
+{
+    n3d_assert(s.texure_ && s.texure_->texels_);
+    raster_lanes<simd4_t>(s, t, texture_shade_t(s.texure_));
+}
+
+N3D_TARGET_AVX2
+void n3d_raster_texture_raster_avx2(
+    const n3d_rasterizer_t::state_t& s,
+    const n3d_rasterizer_t::triangle_t& t,
+    void* user)
+{
+    n3d_assert(s.texure_ && s.texure_->texels_);
+    raster_lanes<simd8_t>(s, t, texture_shade_t(s.texure_));
+}
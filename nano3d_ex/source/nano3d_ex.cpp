@@ -1,4 +1,5 @@
 #include "../nano3d_ex.h"
+#include "source/n3d_cpu.h"
 
 #define RASTER_PROTO(NAME)                            \
     void NAME(                                        \
@@ -11,6 +12,9 @@ RASTER_PROTO(n3d_raster_rgb_raster)
 RASTER_PROTO(n3d_raster_texture_raster)
 RASTER_PROTO(n3d_raster_depth_raster)
 RASTER_PROTO(n3d_raster_depth_raster_sse)
+RASTER_PROTO(n3d_raster_depth_raster_avx2)
+RASTER_PROTO(n3d_raster_texture_raster_sse)
+RASTER_PROTO(n3d_raster_texture_raster_avx2)
 
 n3d_rasterizer_t* n3d_rasterizer_new(n3d_rasterizer_e type)
 {
@@ -29,7 +33,12 @@ n3d_rasterizer_t* n3d_rasterizer_new(n3d_rasterizer_e type)
         rast.raster_proc_ = n3d_raster_depth_raster;
         return new n3d_rasterizer_t(rast);
     case n3d_raster_depth_sse:
-        rast.raster_proc_ = n3d_raster_depth_raster_sse;
+        rast.raster_proc_ = (n3d_cpu_features() & n3d_cpu_avx2) ?
+            n3d_raster_depth_raster_avx2 : n3d_raster_depth_raster_sse;
+        return new n3d_rasterizer_t(rast);
+    case n3d_raster_texture_sse:
+        rast.raster_proc_ = (n3d_cpu_features() & n3d_cpu_avx2) ?
+            n3d_raster_texture_raster_avx2 : n3d_raster_texture_raster_sse;
         return new n3d_rasterizer_t(rast);
     default:
         return nullptr;
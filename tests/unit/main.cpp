@@ -3,6 +3,8 @@
 
 extern bool thread_test_1();
 extern bool thread_test_2();
+extern bool thread_test_2_batch();
+extern bool thread_test_3();
 
 typedef bool (*test_t)();
 
@@ -14,6 +16,8 @@ struct test_cast_t {
 test_cast_t tests[] = {
     { thread_test_1, "thread test 1" },
     { thread_test_2, "thread test 2" },
+    { thread_test_2_batch, "thread test 2 batched" },
+    { thread_test_3, "thread test 3 bins" },
     { nullptr, nullptr }
 };
 
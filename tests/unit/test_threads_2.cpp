@@ -1,3 +1,6 @@
+#include <atomic>
+#include <chrono>
+
 #include <source/n3d_pipe.h>
 #include <source/n3d_thread.h>
 
@@ -39,6 +42,81 @@ struct my_thread_t : public n3d_thread_t {
     }
 };
 
+// consumer which takes items up to a batch at a time and checks that they
+// arrive in order
+struct batch_thread_t : public n3d_thread_t {
+
+    static const uint32_t c_max_batch = 64;
+
+    n3d_pipe_t<uint64_t, 256> pipe_;
+    const uint32_t batch_;
+    // number of items received, published for the producer
+    std::atomic<uint64_t> count_;
+    bool ok_;
+
+    batch_thread_t(uint32_t batch)
+        : n3d_thread_t()
+        , pipe_()
+        , batch_(batch)
+        , count_(0)
+        , ok_(true)
+    {
+    }
+
+    virtual void thread_func()
+    {
+        uint64_t out[c_max_batch];
+        uint64_t next = count_;
+        while (is_active()) {
+            const uint32_t num = pipe_.pop_n(out, batch_);
+            if (!num) {
+                n3d_yield();
+                continue;
+            }
+            for (uint32_t i = 0; i < num; ++i) {
+                ok_ &= (out[i] == next++);
+            }
+            count_.store(next, std::memory_order_release);
+        }
+    }
+};
+
+// push items in random sized batches of up to batch and return the items
+// per second which made it through the pipe
+double pipe_throughput(uint32_t batch, bool& ok)
+{
+    static const uint64_t itterations = 1 << 22;
+
+    batch_thread_t thread(batch);
+    thread.start();
+
+    uint64_t rng = seed() | 1;
+    uint64_t in[batch_thread_t::c_max_batch];
+
+    const auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < itterations;) {
+        const uint32_t num = 1 + uint32_t(rand64(rng) % batch);
+        for (uint32_t j = 0; j < num; ++j) {
+            in[j] = i + j;
+        }
+        const uint32_t pushed = thread.pipe_.push_n(in, num);
+        if (!pushed) {
+            n3d_yield();
+        }
+        i += pushed;
+    }
+    while (thread.count_.load(std::memory_order_acquire) < itterations) {
+        n3d_yield();
+    }
+    const auto end = std::chrono::steady_clock::now();
+
+    thread.stop();
+    ok &= thread.ok_;
+
+    const double secs = std::chrono::duration<double>(end - start).count();
+    return double(itterations) / secs;
+}
+
 } // namespace {}
 
 bool thread_test_2()
@@ -65,3 +143,13 @@ bool thread_test_2()
     thread.stop();
     return true;
 }
+
+bool thread_test_2_batch()
+{
+    bool ok = true;
+    // single items against batches of up to 64
+    const double single = pipe_throughput(1, ok);
+    const double batched = pipe_throughput(batch_thread_t::c_max_batch, ok);
+    printf("%.1fM/s single, %.1fM/s batched ", single / 1e6, batched / 1e6);
+    return ok;
+}
@@ -0,0 +1,136 @@
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <source/n3d_bin.h>
+#include <source/n3d_schedule.h>
+
+#include "test_common.h"
+
+namespace {
+
+static const uint32_t c_num_bins = 4;
+static const uint32_t c_num_workers = 6;
+static const uint32_t c_commands = 1 << 20;
+
+// what the rasterizer of a bin has seen
+struct bin_record_t {
+
+    bin_record_t(const n3d_rasterizer_t::triangle_t* base)
+        : base_(base)
+        , next_(0)
+        , count_(0)
+        , rng_(seed() | 1)
+        , ok_(true)
+    {
+    }
+
+    // commands carry triangles from here in the order they were sent
+    const n3d_rasterizer_t::triangle_t* base_;
+    // index of the next triangle expected.  only the thread holding the bin
+    // touches this.
+    uint32_t next_;
+    // commands processed, published for the producer
+    std::atomic<uint32_t> count_;
+    uint64_t rng_;
+    bool ok_;
+};
+
+// stand in rasterizer which checks that a bins commands arrive in order
+void record_proc(
+    const n3d_rasterizer_t::state_t& state,
+    const n3d_rasterizer_t::triangle_t& triangle,
+    void* user)
+{
+    bin_record_t& rec = *static_cast<bin_record_t*>(user);
+    rec.ok_ &= uint32_t(&triangle - rec.base_) == rec.next_++;
+
+    // stall now and then so that bins go idle and get queued again
+    if ((rand64(rec.rng_) & 0xfff) == 0) {
+        sleep(rec.rng_ & 0x3f);
+    }
+    rec.count_.store(rec.next_, std::memory_order_release);
+}
+
+} // namespace {}
+
+// one producer sends commands to a few bins which the workers process.  a
+// bin queued while another thread still holds it must not be lost, or its
+// commands are left in the pipe for good.
+bool thread_test_3()
+{
+    n3d_command_pool_t pool;
+    std::vector<n3d_rasterizer_t::triangle_t> triangle(c_commands);
+
+    std::unique_ptr<bin_record_t> record[c_num_bins];
+    n3d_rasterizer_t rasterizer[c_num_bins];
+    n3d_bin_t bin[c_num_bins];
+    uint32_t sent[c_num_bins] = {};
+
+    for (uint32_t i = 0; i < c_num_bins; ++i) {
+        record[i].reset(new bin_record_t(triangle.data()));
+        rasterizer[i].raster_proc_ = record_proc;
+        rasterizer[i].user_ = record[i].get();
+        bin[i].rasterizer_ = &rasterizer[i];
+        bin[i].pipe_.init(&pool);
+    }
+
+    n3d_schedule_t schedule;
+    schedule.add(bin, c_num_bins);
+    schedule.start(c_num_workers, false);
+
+    uint64_t rng = seed() | 1;
+    for (uint32_t i = 0; i < c_commands; ++i) {
+
+        // pause now and then so that the workers drain the bins and go idle,
+        // and yield often so that they race with the sends
+        const uint64_t r = rand64(rng);
+        if ((r & 0xffff) == 0) {
+            sleep((r >> 16) & 0xff);
+        } else if ((r & 0x3f) == 0) {
+            n3d_yield();
+        }
+
+        const uint32_t b = uint32_t(rand64(rng) % c_num_bins);
+        n3d_command_t cmd;
+        cmd.command_ = n3d_command_t::cmd_triangle;
+        cmd.triangle_ = &triangle[sent[b]++];
+        n3d_bin_send(&bin[b], cmd);
+    }
+
+    // wait for the workers to catch up, giving up if they stop making
+    // progress as a lost bin will never be processed
+    typedef std::chrono::steady_clock clock_t;
+    uint32_t last = 0;
+    clock_t::time_point progress = clock_t::now();
+    while (true) {
+        uint32_t done = 0;
+        for (uint32_t i = 0; i < c_num_bins; ++i) {
+            done += record[i]->count_.load(std::memory_order_acquire);
+        }
+        if (done == c_commands) {
+            break;
+        }
+        if (done != last) {
+            last = done;
+            progress = clock_t::now();
+        } else if (clock_t::now() - progress > std::chrono::seconds(2)) {
+            break;
+        }
+        n3d_yield();
+    }
+
+    schedule.stop();
+
+    // every command was processed in order and nothing is left behind
+    bool ok = true;
+    for (uint32_t i = 0; i < c_num_bins; ++i) {
+        ok &= record[i]->ok_;
+        ok &= record[i]->count_ == sent[i];
+        n3d_command_t cmd;
+        ok &= !bin[i].pipe_.pop(cmd);
+        ok &= bin[i].lock_.atom_ == n3d_spinlock_t::c_unlocked;
+    }
+    return ok;
+}